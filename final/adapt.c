@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "params.h"
+#include "state.h"
+#include "buckets.h"
+#include "adapt.h"
+
+/*@T
+ * \subsection{Splitting and merging}
+ *
+ * A particle stands for $w_i = m_i/m$ unmerged particles, where $m$ is
+ * [[s->mass]].  Merging up to four unmerged particles gives a particle
+ * with the summed mass, the mass-weighted position and velocities, and
+ * size $h_i = h \sqrt{w_i}$, so that it covers the same area as the
+ * particles it replaced.  Splitting reverses this: the $w_i$ daughters
+ * sit on a ring of radius $h/2.6$ (half the lattice spacing) around
+ * the parent and inherit its velocities.  Mass and momentum are
+ * conserved exactly either way.  Only one level of merging is allowed,
+ * so $h_i \leq 2h$; cells are at least $2h$ wide, so the ordinary
+ * $3 \times 3$ stencil still finds every neighbor and no second level
+ * of cells is needed.
+ *
+ * Resolution is decided per cell.  A cell is near the surface if any
+ * cell in its $3 \times 3$ block is empty (walls do not count as
+ * empty); coarse particles in such cells are split.  Unmerged particles
+ * are merged only in cells whose whole $3 \times 3$ block is away from
+ * the surface, which leaves a band of cells where neither happens and
+ * keeps particles from flipping back and forth.  Within a cell,
+ * particles are grouped by blocks twice the initial lattice spacing,
+ * so merging a fresh lattice gives a lattice again.
+ *@c*/
+#define MAX_MERGE  4
+#define MAX_GROUPS 32
+
+static inline int weight(sim_state_t* s, int i)
+{
+    return (int) (s->m[i] / s->mass + 0.5f);
+}
+
+static void ring_offset(int k, int w, float r, float* dx, float* dy)
+{
+    float th = (float) M_PI/4 + 2 * (float) M_PI * k / w;
+    *dx = r * cosf(th);
+    *dy = r * sinf(th);
+}
+
+static float clamp01(float x)
+{
+    return x < 0 ? 0 : (x > 1 ? 1 : x);
+}
+
+/*@T
+ *
+ * The daughters must land inside the domain, and no two of them on
+ * the same point, or the kernels divide by their zero distance.  In a
+ * periodic direction, a daughter that falls across the seam wraps
+ * around to the far side.  Next to a wall, pinning each daughter to
+ * the wall would pile several of them onto one point, so the whole
+ * ring moves inward instead, just far enough to fit; the daughters
+ * keep their spacing, and the center of mass moves by less than the
+ * ring radius.
+ *@c*/
+static float ring_coord(float c, float d, float r, int periodic)
+{
+    if (!periodic) {
+        c = c < r ? r : (c > 1-r ? 1-r : c);
+        return clamp01(c + d);
+    }
+    float x = c + d;
+    if (x <  0) x += 1;
+    if (x >= 1) x -= 1;
+    return x;
+}
+
+static void ring_point(sim_param_t* params, float x0, float y0, int k, int w,
+                       float* x, float* y)
+{
+    float r = params->h / 2.6f;
+    float dx, dy;
+    ring_offset(k, w, r, &dx, &dy);
+    *x = ring_coord(x0, dx, r, params->periodic & PERIODIC_X);
+    *y = ring_coord(y0, dy, r, params->periodic & PERIODIC_Y);
+}
+
+static void copy_particle(sim_state_t* s, int dst, int src)
+{
+    s->rho[dst] = s->rho[src];
+    s->x[dst]   = s->x[src];
+    s->y[dst]   = s->y[src];
+    s->vhx[dst] = s->vhx[src];
+    s->vhy[dst] = s->vhy[src];
+    s->vx[dst]  = s->vx[src];
+    s->vy[dst]  = s->vy[src];
+    s->ax[dst]  = s->ax[src];
+    s->ay[dst]  = s->ay[src];
+    s->m[dst]   = s->m[src];
+    s->hs[dst]  = s->hs[src];
+    if (s->nnb)
+        s->nnb[dst] = s->nnb[src];
+}
+
+/* Fold particle j into i; j is left with zero mass */
+static void merge_into(sim_state_t* s, int i, int j)
+{
+    float mi = s->m[i], mj = s->m[j];
+    float wi = mi / (mi+mj), wj = mj / (mi+mj);
+    s->rho[i] = wi*s->rho[i] + wj*s->rho[j];
+    s->x[i]   = wi*s->x[i]   + wj*s->x[j];
+    s->y[i]   = wi*s->y[i]   + wj*s->y[j];
+    s->vhx[i] = wi*s->vhx[i] + wj*s->vhx[j];
+    s->vhy[i] = wi*s->vhy[i] + wj*s->vhy[j];
+    s->vx[i]  = wi*s->vx[i]  + wj*s->vx[j];
+    s->vy[i]  = wi*s->vy[i]  + wj*s->vy[j];
+    s->ax[i]  = wi*s->ax[i]  + wj*s->ax[j];
+    s->ay[i]  = wi*s->ay[i]  + wj*s->ay[j];
+    s->m[i]   = mi + mj;
+    s->m[j]   = 0;
+}
+
+/* Split particle i into w daughters: one in place, the rest at the end */
+static void split(sim_state_t* s, sim_param_t* params, int i, int w)
+{
+    float x0 = s->x[i], y0 = s->y[i];
+    float m0 = s->m[i] / w;
+    for (int k = 0; k < w; ++k) {
+        int j = i;
+        if (k > 0) {
+            j = s->n++;
+            copy_particle(s, j, i);
+        }
+        ring_point(params, x0, y0, k, w, &s->x[j], &s->y[j]);
+        s->m[j]  = m0;
+        s->hs[j] = params->h;
+    }
+}
+
+/*@T
+ *
+ * The surface flags of the occupied cells live in the first row of
+ * the arena's per-thread count table, which the rebinning sort
+ * rewrites from scratch, so adaptation needs no storage of its own.
+ * Merged-away particles are marked with zero mass and squeezed out at
+ * the end.  A cell is at the surface if any cell around it in the
+ * domain is empty; the sparse grid has no bins for empty cells, so we
+ * look at the neighboring grid cells rather than bins.  Only occupied
+ * cells can merge or split anything, so both passes walk the active
+ * list.
+ *@c*/
+static void mark_surface(sim_state_t* s, sim_param_t* params, int* surface)
+{
+    const int* start = s->bin_start;
+    for (int ka = 0; ka < s->active.n; ++ka) {
+        int b = s->active.cells[ka];
+        int nns[9];
+        neighbor_cells(s, params, bin_cell(s, b), nns);
+        surface[b] = 0;
+        for (int k = 0; k < 9; ++k) {
+            if (nns[k] == -1)
+                continue;
+            int bk = cell_bin(s, nns[k]);
+            if (bk == -1 || start[bk+1] == start[bk])
+                surface[b] = 1;
+        }
+    }
+}
+
+static int merge_cell(sim_state_t* s, sim_param_t* params, int b)
+{
+    float block = 2 * params->h / 1.3f;
+    int key[MAX_GROUPS], lead[MAX_GROUPS], size[MAX_GROUPS];
+    int ngroups = 0, merged = 0;
+    for (int k = s->bin_start[b]; k < s->bin_start[b+1]; ++k) {
+        int i = s->bin_ids[k];
+        if (weight(s, i) != 1)
+            continue;
+        int blk = (int) (s->x[i] / block) + 65536 * (int) (s->y[i] / block);
+        int g = 0;
+        while (g < ngroups && key[g] != blk)
+            ++g;
+        if (g == ngroups) {
+            if (ngroups == MAX_GROUPS)
+                continue;
+            key[g] = blk;
+            lead[g] = i;
+            size[g] = 1;
+            ++ngroups;
+        } else if (size[g] < MAX_MERGE) {
+            merge_into(s, lead[g], i);
+            ++size[g];
+            ++merged;
+        }
+    }
+    for (int g = 0; g < ngroups; ++g)
+        s->hs[lead[g]] = params->h * sqrtf((float) size[g]);
+    return merged;
+}
+
+int adapt_particles(sim_state_t* s, sim_param_t* params)
+{
+    int* surface = s->arena.counts;
+    mark_surface(s, params, surface);
+
+    // Merge unmerged particles in cells well away from the surface
+    int changed = 0;
+    for (int ka = 0; ka < s->active.n; ++ka) {
+        int b = s->active.cells[ka];
+        const int* nns = s->active.nbrs + 9*ka;
+        int quiet = 1;
+        for (int k = 0; k < 9; ++k)
+            if (nns[k] != -1 && surface[nns[k]])
+                quiet = 0;
+        if (quiet)
+            changed += merge_cell(s, params, b);
+    }
+
+    // Split merged particles in surface cells
+    int n0 = s->n;
+    for (int i = 0; i < n0; ++i) {
+        int w = weight(s, i);
+        if (w > 1 && surface[cell_bin(s, s->arena.cell[i])]) {
+            split(s, params, i, w);
+            ++changed;
+        }
+    }
+
+    if (changed == 0)
+        return 0;
+
+    // Squeeze out merged-away particles; no particle is in a cell yet
+    int n = s->n;
+    for (int i = 0; i < n; ++i) {
+        while (n > i && s->m[n-1] == 0)
+            --n;
+        if (i < n && s->m[i] == 0)
+            copy_particle(s, i, --n);
+    }
+    s->n = n;
+    for (int i = 0; i < n; ++i)
+        s->arena.cell[i] = -1;
+    return changed;
+}
+
+int adapt_resolution(sim_state_t* s, sim_param_t* params)
+{
+    int changed = adapt_particles(s, params);
+    if (changed)
+        update_bins(s, params);
+    return changed;
+}
+
+/*@T
+ *
+ * For output, each particle is drawn as the particles it stands for,
+ * on the same ring that [[split]] would put them on.  The weights add
+ * up to [[s->nmax]], so every frame has the same number of points.
+ * Each point takes its particle's channel value from [[q]] if one is
+ * given.
+ *@c*/
+void adapt_frame(sim_state_t* s, sim_param_t* params,
+                 float* x, float* y, int* c, const int* q)
+{
+    int k = 0;
+    for (int i = 0; i < s->n; ++i) {
+        int w = weight(s, i);
+        for (int j = 0; j < w && k < s->nmax; ++j, ++k) {
+            x[k] = s->x[i];
+            y[k] = s->y[i];
+            if (w > 1)
+                ring_point(params, s->x[i], s->y[i], j, w, &x[k], &y[k]);
+            c[k] = q ? q[i] : (w > 1);
+        }
+    }
+    for (; k < s->nmax; ++k) {
+        x[k] = y[k] = 0;
+        c[k] = 0;
+    }
+}
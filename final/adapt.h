@@ -0,0 +1,27 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{Adaptive resolution}
+ *
+ * The [[adapt_resolution]] routine merges particles in the quiet bulk
+ * of the fluid and splits them again near the free surface.  It may
+ * change [[s->n]] and renumber particles, and it rebuilds the bins
+ * when it does.  The [[adapt_particles]] routine does the same but
+ * leaves the bins for the caller to rebuild with [[update_bins_ws]],
+ * so that the step engine can sort them with its whole team; it
+ * returns zero if nothing changed and the bins are still good.  Since
+ * the frame format fixes the number of points, [[adapt_frame]] draws
+ * each particle as the [[s->nmax]] unmerged particles it stands for;
+ * merged particles get color 1 unless channel values [[q]] are given.
+ *@c*/
+int  adapt_resolution(sim_state_t* s, sim_param_t* params);
+int  adapt_particles(sim_state_t* s, sim_param_t* params);
+void adapt_frame(sim_state_t* s, sim_param_t* params,
+                 float* x, float* y, int* c, const int* q);
+
+/*@q*/
+#endif /* ADAPT_H */
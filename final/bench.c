@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "leapfrog.h"
+#include "timing.h"
+#include "buckets.h"
+#include "scenario.h"
+#include "step.h"
+
+/*@T
+ * \section{Benchmark driver}
+ *
+ * The [[bench.x]] driver runs every scenario in the scenario table
+ * at a few particle sizes, times a fixed number of steps of each, and
+ * writes the results as JSON.  Given a baseline file written by an
+ * earlier run, it also compares throughput (particle-steps per second)
+ * case by case and exits with a nonzero status if any case slowed down
+ * by more than the tolerance.  The output puts one case on each line,
+ * which keeps the baseline reader trivial.
+ *@c*/
+static const float bench_sizes[] = { 2e-2, 1e-2, 5e-3 };
+#define NSIZES ((int) (sizeof(bench_sizes)/sizeof(bench_sizes[0])))
+
+typedef struct bench_result_t {
+    const char* scenario;
+    float  h;
+    int    n;
+    int    steps;
+    double seconds;
+    double rate;     /* Particle-steps per second */
+} bench_result_t;
+
+typedef struct bench_opts_t {
+    char*  fname;    /* JSON output file         */
+    char*  baseline; /* Baseline to compare with */
+    float  tol;      /* Allowed relative slowdown */
+    int    nsteps;   /* Timed steps per case     */
+    int    nsizes;   /* Number of sizes to run   */
+    char*  only;     /* Run only this scenario   */
+    int    tile;     /* Task tile size (0: none) */
+} bench_opts_t;
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "bench\n"
+            "\t-h: print this message\n"
+            "\t-o: JSON output file name (bench.json)\n"
+            "\t-b: baseline JSON file to compare against\n"
+            "\t-r: allowed relative throughput loss (0.05)\n"
+            "\t-f: timed steps per case (50)\n"
+            "\t-l: number of sizes to run, 1-%d (%d)\n"
+            "\t-S: run only the named scenario\n"
+            "\t-T: run steps as a task graph over tiles of this many cells\n",
+            NSIZES, NSIZES);
+}
+
+static int get_bench_opts(int argc, char** argv, bench_opts_t* opts)
+{
+    extern char* optarg;
+    int c;
+    opts->fname    = "bench.json";
+    opts->baseline = NULL;
+    opts->tol      = 0.05;
+    opts->nsteps   = 50;
+    opts->nsizes   = NSIZES;
+    opts->only     = NULL;
+    opts->tile     = 0;
+    while ((c = getopt(argc, argv, "ho:b:r:f:l:S:T:")) != -1) {
+        switch (c) {
+        case 'o': opts->fname    = optarg; break;
+        case 'b': opts->baseline = optarg; break;
+        case 'r': opts->tol      = (float) atof(optarg); break;
+        case 'f': opts->nsteps   = atoi(optarg); break;
+        case 'l': opts->nsizes   = atoi(optarg); break;
+        case 'S': opts->only     = optarg; break;
+        case 'T': opts->tile     = atoi(optarg); break;
+        default:
+            print_usage();
+            return -1;
+        }
+    }
+    if (opts->nsizes < 1 || opts->nsizes > NSIZES)
+        opts->nsizes = NSIZES;
+    return 0;
+}
+
+/*@T
+ *
+ * Each case mirrors the time step loop in [[main]]: one start-up step,
+ * then [[nsteps]] timed leapfrog steps through [[run_steps]], which
+ * rebins after every step and reorders the bins once per [[npframe]]
+ * steps.  The simulation itself decides when to reorder from step
+ * timings, which differ from run to run; a yardstick should do the
+ * same work every time, so the benchmark fixes the interval.  No
+ * output is written.
+ *@c*/
+static int run_case(sim_param_t* params, int nsteps, bench_result_t* r)
+{
+    sim_state_t* state = init_particles(params);
+    if (state == NULL)
+        return -1;
+    float dt = params->dt;
+
+    compute_accel(state, params);
+    leapfrog_start(state, params, dt);
+    update_bins(state, params);
+    optimize_bins(state, params, 1);
+
+    tic(1);
+    double particle_steps = run_steps(state, params, nsteps, NULL, NULL);
+    r->seconds  = toc(1);
+    r->scenario = params->scenario;
+    r->h        = params->h;
+    r->n        = state->n;
+    r->steps    = nsteps;
+    r->rate     = particle_steps / r->seconds;
+    free_state(state);
+    return 0;
+}
+
+static void write_results(FILE* fp, bench_result_t* rs, int nr, int nsteps)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"benchmark\": \"sph\",\n");
+    fprintf(fp, "  \"threads\": %d,\n", omp_get_max_threads());
+    fprintf(fp, "  \"steps\": %d,\n", nsteps);
+    fprintf(fp, "  \"results\": [\n");
+    for (int i = 0; i < nr; ++i)
+        fprintf(fp, "    {\"scenario\": \"%s\", \"h\": %g, \"n\": %d, "
+                "\"steps\": %d, \"seconds\": %g, \"steps_per_sec\": %g, "
+                "\"particle_steps_per_sec\": %g}%s\n",
+                rs[i].scenario, rs[i].h, rs[i].n, rs[i].steps,
+                rs[i].seconds, rs[i].steps / rs[i].seconds, rs[i].rate,
+                i+1 < nr ? "," : "");
+    fprintf(fp, "  ]\n}\n");
+}
+
+/*@T
+ *
+ * The baseline reader only understands the one-case-per-line layout
+ * that [[write_results]] produces.  Cases are matched on scenario name
+ * and particle size; cases that are missing from the baseline are
+ * reported but do not count as regressions.
+ *@c*/
+static int parse_case(const char* line, char* name, float* h, double* rate)
+{
+    const char* p = strstr(line, "\"scenario\": \"");
+    const char* q = strstr(line, "\"h\": ");
+    const char* r = strstr(line, "\"particle_steps_per_sec\": ");
+    if (!p || !q || !r)
+        return 0;
+    return sscanf(p, "\"scenario\": \"%63[^\"]\"", name) == 1 &&
+        sscanf(q, "\"h\": %g", h) == 1 &&
+        sscanf(r, "\"particle_steps_per_sec\": %lg", rate) == 1;
+}
+
+static int compare_baseline(const char* fname, bench_result_t* rs, int nr,
+                            float tol)
+{
+    FILE* fp = fopen(fname, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open baseline %s\n", fname);
+        return -1;
+    }
+
+    int nregress = 0;
+    int* found = (int*) calloc(nr, sizeof(int));
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char name[64];
+        float h;
+        double base;
+        if (!parse_case(line, name, &h, &base))
+            continue;
+        for (int i = 0; i < nr; ++i) {
+            if (strcmp(rs[i].scenario, name) != 0 || rs[i].h != h)
+                continue;
+            double ratio = rs[i].rate / base;
+            int regress = ratio < 1-tol;
+            nregress += regress;
+            found[i] = 1;
+            printf("%-8s h=%-7g %12.4g -> %12.4g  (%+6.1f%%)%s\n",
+                   name, h, base, rs[i].rate, 100*(ratio-1),
+                   regress ? "  REGRESSION" : "");
+        }
+    }
+    for (int i = 0; i < nr; ++i)
+        if (!found[i])
+            printf("%-8s h=%-7g not in baseline\n", rs[i].scenario, rs[i].h);
+    free(found);
+    fclose(fp);
+    return nregress;
+}
+
+int main(int argc, char** argv)
+{
+    bench_opts_t opts;
+    if (get_bench_opts(argc, argv, &opts) != 0)
+        exit(-1);
+
+    int maxr = scenario_count() * NSIZES;
+    bench_result_t* rs = (bench_result_t*) calloc(maxr, sizeof(bench_result_t));
+    int nr = 0;
+    for (int i = 0; i < scenario_count(); ++i) {
+        sim_param_t params;
+        default_params(&params);
+        params.scenario = (char*) scenario_name(i);
+        params.tile     = opts.tile;
+        params.reorder  = params.npframe;
+        if (opts.only && strcmp(opts.only, params.scenario) != 0)
+            continue;
+        for (int j = 0; j < opts.nsizes; ++j) {
+            params.h = bench_sizes[j];
+            if (run_case(&params, opts.nsteps, &rs[nr]) != 0)
+                exit(-1);
+            printf("%-8s h=%-7g n=%-7d %8.3f s  %12.4g particle-steps/s\n",
+                   rs[nr].scenario, rs[nr].h, rs[nr].n, rs[nr].seconds,
+                   rs[nr].rate);
+            ++nr;
+        }
+    }
+
+    FILE* fp = fopen(opts.fname, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", opts.fname);
+        exit(-1);
+    }
+    write_results(fp, rs, nr, opts.nsteps);
+    fclose(fp);
+
+    int status = 0;
+    if (opts.baseline) {
+        int nregress = compare_baseline(opts.baseline, rs, nr, opts.tol);
+        if (nregress != 0) {
+            if (nregress > 0)
+                printf("%d case(s) regressed by more than %g%%\n",
+                       nregress, 100*opts.tol);
+            status = 1;
+        }
+    }
+    free(rs);
+    return status;
+}
@@ -1,157 +1,404 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <omp.h>
 
 #include "buckets.h"
+#include "perfctr.h"
 
 int get_bin_pos(sim_state_t* state, sim_param_t* params, int id){
 	const float* restrict x = state->x;
-	const float h = params->h;	
+	const float* restrict y = state->y;
 	const int MAX = state->MAX;
-	int ix = (int) (x[2*id+0] / (2*h));
-	int iy = (int) (x[2*id+1] / (2*h));
+	// Cells are 1/MAX >= h wide; clamp so particles on the far walls
+	// land in the last row/column instead of past the end of bins.
+	int ix = (int) (x[id] * MAX);
+	int iy = (int) (y[id] * MAX);
+	if (ix < 0) ix = 0;
+	if (ix > MAX-1) ix = MAX-1;
+	if (iy < 0) iy = 0;
+	if (iy > MAX-1) iy = MAX-1;
 	return (ix+iy*MAX);
 }	
 
 void build_bins(sim_state_t* state, sim_param_t* params){
-
 	int n = state->n;
-	bin_t* bins = state->bins;
-	particle_t* ps = state->ps;
-	init_bins(bins, state->bin_size);
-	//build bins with proper particle head pointer
-	for(int i = 0; i < n; ++i){
-		//figure out position for b
-		ps[i].x_idx = 2*i+0;
-		ps[i].y_idx = 2*i+1;
-		ps[i].id = i;
-		ps[i].next = NULL;
-		put_particle_to_bins(state, params, &ps[i]);
-	}
+	// With no particle in a cell yet, update_bins does a full sort
+	for (int i = 0; i < n; ++i)
+		state->arena.cell[i] = -1;
+	update_bins(state, params);
 }
 
-void init_bins(bin_t* bins, int bin_size){
-	for(int i = 0; i < bin_size; ++i){
-		bins[i].id = i;
-		bins[i].phead = NULL;
-	}
+/*@T
+ *
+ * The [[neighbor_cells]] routine lists the $3 \times 3$ block of grid
+ * cells around [[cell]].  Cells that fall off a wall are marked $-1$;
+ * in a periodic direction they wrap around to the far side of the
+ * domain instead.  With fewer than three cells across a periodic
+ * direction, the wrapped stencil would name the same cell twice, so
+ * repeats are dropped as well.  The [[neighbors3]] routine does the
+ * same for a bin, naming the neighbors by bin; on the sparse grid,
+ * empty cells have no bin and are marked $-1$ too.
+ *@c*/
+void neighbors3(sim_state_t* state, sim_param_t* param, int bidx, int* nns4) {
+	neighbor_cells(state, param, bin_cell(state, bidx), nns4);
+	if (state->bin_key == NULL)
+		return;
+	for (int k = 0; k < 9; ++k)
+		if (nns4[k] != -1)
+			nns4[k] = cell_bin(state, nns4[k]);
 }
 
-particle_t* get_particle_from_bins(sim_state_t* state, sim_param_t* params, int particle_id){
-	bin_t* bins = state->bins;
-	int bidx = get_bin_pos(state, params, particle_id);
-	particle_t *p = bins[bidx].phead;
+void neighbor_cells(sim_state_t* state, sim_param_t* param, int cell, int* nns4) {
+	const int MAX = state->MAX;
+	const int px = param->periodic & PERIODIC_X;
+	const int py = param->periodic & PERIODIC_Y;
+	const int ix = cell % MAX;
+	const int iy = cell / MAX;
 
-	if (p == NULL) return NULL;
-	while(p->id != particle_id && p->next != NULL){
-		p = p->next;
+	int k = 0;
+	for (int dy = -1; dy <= 1; ++dy) {
+		int jy = iy + dy;
+		if (py) jy = (jy + MAX) % MAX;
+		for (int dx = -1; dx <= 1; ++dx) {
+			int jx = ix + dx;
+			if (px) jx = (jx + MAX) % MAX;
+			int bj = (jx < 0 || jx >= MAX || jy < 0 || jy >= MAX) ?
+				-1 : jx + jy*MAX;
+			for (int i = 0; i < k && bj != -1; ++i)
+				if (nns4[i] == bj) bj = -1;
+			nns4[k++] = bj;
+		}
 	}
-	return p;
 }
 
+/*@T
+ * \subsection{The sparse grid}
+ *
+ * The dense grid has a bin for every cell of the box, so its storage
+ * and every sweep over the bins grow with the area of the box over
+ * $h^2$, however few cells hold particles.  With [[params->sparse]]
+ * set, only occupied cells get bins: [[bin_key[b]]] is the grid cell
+ * of bin $b$, and a hash table maps a grid cell back to its bin.
+ * Rebinning puts the occupied cells in the table, sorts their keys so
+ * that the bins come in the same row-major order as on the dense
+ * grid, and numbers them.  The kernels then see exactly the same
+ * neighbors in exactly the same order, so the results are bit for bit
+ * those of the dense grid, while storage and sweeps are proportional
+ * to the occupied cells.
+ *
+ * The table uses open addressing with linear probing and stays at
+ * most half full, so a miss ends after a probe or two.  The hash
+ * scatters the rows but keeps the cells of a row in consecutive
+ * slots, so the three cells of a stencil row usually share a cache
+ * line.  The table and the bin arrays only ever grow, so a run in
+ * steady state still does no allocation.
+ *@c*/
+static int compare_ints(const void* a, const void* b)
+{
+	int x = *(const int*) a, y = *(const int*) b;
+	return (x > y) - (x < y);
+}
+
+static void hash_cells(sim_state_t* state, sim_param_t* params)
+{
+	const int n = state->n;
+	const int* cell = state->arena.cell;
+	int m = 0;
+	for (int restart = 1; restart; ) {
+		restart = 0;
+		int* slots = state->hash.slots;
+		unsigned mask = state->hash.cap - 1;
+		for (int k = 0; k < state->hash.cap; ++k)
+			slots[2*k] = -1;
+		m = 0;
+		for (int i = 0; i < n && !restart; ++i) {
+			unsigned k = cell_hash(state, cell[i]);
+			while (slots[2*k] != -1 && slots[2*k] != cell[i])
+				k = (k+1) & mask;
+			if (slots[2*k] != -1)
+				continue;
+			if (2*(m+1) > state->hash.cap) {
+				reserve_hash(state, params, 2*state->hash.cap);
+				restart = 1;
+				break;
+			}
+			slots[2*k] = cell[i];
+			++m;
+		}
+	}
 
-void put_particle_to_bins(sim_state_t* state, sim_param_t* params, particle_t* p){
-	bin_t* bins = state->bins;
-	int bidx = get_bin_pos(state, params, p->id);
-	particle_t* phead = bins[bidx].phead;
-	p->next = phead;
-	bins[bidx].phead = p;
+	reserve_bins(state, params, m);
+	int* key = state->bin_key;
+	int* slots = state->hash.slots;
+	int b = 0;
+	for (int k = 0; k < state->hash.cap; ++k)
+		if (slots[2*k] != -1)
+			key[b++] = slots[2*k];
+	qsort(key, m, sizeof(int), compare_ints);
+	unsigned mask = state->hash.cap - 1;
+	for (b = 0; b < m; ++b) {
+		unsigned k = cell_hash(state, key[b]);
+		while (slots[2*k] != key[b])
+			k = (k+1) & mask;
+		slots[2*k+1] = b;
+	}
+	state->bin_size = m;
 }
 
-void neighbors3(sim_state_t* state, sim_param_t* param, int bidx, particle_t* p, int* nns4) {
-	int MAX = state->MAX;
+/*@T
+ * \subsection{Rebinning}
+ *
+ * The bins are stored in compressed sparse row form: the particles of
+ * cell $b$ are [[bin_ids[k]]] for [[bin_start[b]]] $\leq k <$
+ * [[bin_start[b+1]]].  After every step, [[update_bins]] recomputes
+ * the cell of each particle in parallel, straight into [[arena.cell]],
+ * and counts how many particles changed cells.  If none did, the bins
+ * are still good.  Otherwise we rebuild them with a parallel counting
+ * sort:
+ * \begin{enumerate}
+ * \item each thread histograms the cells of its static block of
+ *   particles into its own row of [[counts]];
+ * \item a parallel prefix sum over (cell, thread) turns the histograms
+ *   into the position where each thread writes its first particle in
+ *   each cell, and leaves the cell starts in [[bin_start]];
+ * \item each thread scatters the numbers of its block of particles
+ *   into [[bin_ids]];
+ * \item the occupied bins are listed in [[active]], in bin order, with
+ *   their neighbor bins from [[neighbors3]] and empty neighbors
+ *   marked $-1$, so the kernels never visit an empty cell and split
+ *   their work evenly over the cells that have some.
+ * \end{enumerate}
+ * The sort reads only the cells, never the old lists, so it can
+ * overwrite [[bin_ids]] in place.  It is linear in the number of
+ * particles and cells, which is cheap next to the neighbor sweeps
+ * even when only a handful of particles moved.  There is no separate
+ * path that moves only those particles: in this packed layout, moving
+ * one particle to another cell shifts the lists of every cell in
+ * between, so a few movers already cost about as much as the sort,
+ * and leaving gaps for movers would give back the memory the layout
+ * saves.
+ * On the sparse grid, the occupied cells are hashed and numbered
+ * first, on one thread, and the sort runs over their bins.
+ * Like the kernels, [[update_bins_ws]] uses only orphaned worksharing,
+ * so the step engine can call it from inside its parallel region; the
+ * team must be no larger than the [[nthreads]] the arena was sized for.
+ * The scatter uses the same static partition as the histogram, so
+ * each cell lists its particles in increasing index order no matter
+ * how many threads there are.  Rebinning times itself as
+ * [[PHASE_REBIN]], and each barrier between the steps above is a
+ * [[perf_barrier]], so a thread's time in the phase leaves out its
+ * waits for the others.
+ *@c*/
+static void sort_bins_ws(sim_state_t* state, sim_param_t* params)
+{
+	const int n = state->n;
 	const int bin_size = state->bin_size;
+	particle_arena_t* arena = &state->arena;
+	const int* cell = arena->cell;
+	int* ids = state->bin_ids;
+	int* start = state->bin_start;
+	int* tsum  = arena->counts + (size_t) (arena->nthreads+1) * bin_size;
+
+	const int t  = omp_get_thread_num();
+	const int nt = omp_get_num_threads();
+	int* mine = arena->counts + (size_t) t * bin_size;
+	memset(mine, 0, bin_size * sizeof(int));
+
+	// Per-thread histogram
+#pragma omp for schedule(static) nowait
+	for (int i = 0; i < n; ++i)
+		mine[cell_bin(state, cell[i])]++;
+	perf_barrier(PHASE_REBIN);
+
+	// Offsets of each thread within a cell, and cell totals
+	int sum = 0;
+#pragma omp for schedule(static) nowait
+	for (int b = 0; b < bin_size; ++b) {
+		int total = 0;
+		for (int u = 0; u < nt; ++u) {
+			int* c = arena->counts + (size_t) u * bin_size + b;
+			int cu = *c;
+			*c = total;
+			total += cu;
+		}
+		start[b] = total;
+	}
+	perf_barrier(PHASE_REBIN);
+
+	// Exclusive scan of cell totals: local scans, then thread sums
+#pragma omp for schedule(static) nowait
+	for (int b = 0; b < bin_size; ++b) {
+		int c = start[b];
+		start[b] = sum;
+		sum += c;
+	}
+	tsum[t] = sum;
+	perf_barrier(PHASE_REBIN);
+	int base = 0;
+	for (int u = 0; u < t; ++u)
+		base += tsum[u];
+#pragma omp for schedule(static) nowait
+	for (int b = 0; b < bin_size; ++b)
+		start[b] += base;
+#pragma omp single nowait
+	start[bin_size] = n;
+	perf_barrier(PHASE_REBIN);
 
-	nns4[0] = bidx;
-	nns4[1] = bidx + MAX - 1;
-	nns4[2] = bidx + MAX;
-	nns4[3] = bidx + MAX + 1;
-	nns4[4] = bidx - 1;
-	nns4[5] = bidx + 1;
-	nns4[6] = bidx - MAX - 1;
-	nns4[7] = bidx - MAX;
-	nns4[8] = bidx - MAX + 1;
-
-	for (int i = 0; i < 9; ++i) {
-		if (nns4[i] < 0 || nns4[i] >= bin_size) nns4[i] = -1;
+	// Scatter with the same partition as the histogram
+#pragma omp for schedule(static) nowait
+	for (int i = 0; i < n; ++i) {
+		int b = cell_bin(state, cell[i]);
+		ids[start[b] + mine[b]++] = i;
 	}
+	perf_barrier(PHASE_REBIN);
 
+	// Occupied bins, numbered by the same partition as the scan
+	int nocc = 0;
+#pragma omp for schedule(static) nowait
+	for (int b = 0; b < bin_size; ++b)
+		nocc += (start[b+1] > start[b]);
+	tsum[t] = nocc;
+	perf_barrier(PHASE_REBIN);
+	int k = 0;
+	for (int u = 0; u < t; ++u)
+		k += tsum[u];
+#pragma omp single nowait
+	{
+		int total = 0;
+		for (int u = 0; u < nt; ++u)
+			total += tsum[u];
+		reserve_active(state, params, total);
+		state->active.n = total;
+	}
+	perf_barrier(PHASE_REBIN);
+	int* active = state->active.cells;
+#pragma omp for schedule(static) nowait
+	for (int b = 0; b < bin_size; ++b)
+		if (start[b+1] > start[b])
+			active[k++] = b;
+	perf_barrier(PHASE_REBIN);
+
+	const int nactive = state->active.n;
+#pragma omp for schedule(static) nowait
+	for (int ka = 0; ka < nactive; ++ka) {
+		int* nns = state->active.nbrs + 9*ka;
+		neighbors3(state, params, active[ka], nns);
+		for (int c = 0; c < 9; ++c)
+			if (nns[c] != -1 && start[nns[c]+1] == start[nns[c]])
+				nns[c] = -1;
+	}
 }
 
-particle_t* remove_particle_from_bins(sim_state_t* state, int particle_id, int bidx){
-	bin_t* bins = state->bins;
-	if (particle_id < 0) return NULL;
-	particle_t* p_cur = bins[bidx].phead;
-	particle_t* p_prev = NULL;
-	if (p_cur == NULL) return NULL;
-	while(p_cur->id != particle_id && p_cur->next != NULL){
-		p_prev = p_cur;
-		p_cur = p_cur->next;
+int update_bins_ws(sim_state_t* state, sim_param_t* params){
+	const int n = state->n;
+	particle_arena_t* arena = &state->arena;
+	int* cell = arena->cell;
+
+	perf_begin(PHASE_REBIN);
+	// Flip between two counters so a thread still reading the last
+	// total never sees this call's reset
+#pragma omp single nowait
+	{
+		arena->epoch = 1 - arena->epoch;
+		arena->moved[arena->epoch] = 0;
 	}
-	if (p_cur->id != particle_id) return NULL;
-	if (p_prev == NULL) {
-		bins[bidx].phead = p_cur->next;
-		p_cur->next = NULL;
-		return p_cur;
+	perf_barrier(PHASE_REBIN);
+	const int e = arena->epoch;
+
+	int moved = 0;
+#pragma omp for schedule(static) nowait
+	for (int i = 0; i < n; ++i) {
+		int b = get_bin_pos(state, params, i);
+		moved += (b != cell[i]);
+		cell[i] = b;
 	}
-	p_prev->next = p_cur->next;
-	p_cur->next = NULL;
-	return p_cur;
+#pragma omp atomic
+	arena->moved[e] += moved;
+	perf_barrier(PHASE_REBIN);
+	moved = arena->moved[e];
+
+	if (moved == 0) {
+		perf_end(PHASE_REBIN);
+		return 1;
+	}
+	if (state->bin_key) {
+#pragma omp single nowait
+		hash_cells(state, params);
+		perf_barrier(PHASE_REBIN);
+	}
+	sort_bins_ws(state, params);
+	perf_end(PHASE_REBIN);
+#pragma omp barrier
+	return 1;
 }
 
 int update_bins(sim_state_t* state, sim_param_t* params){
-	bin_t* bins = state->bins;
-	const int bin_size = state->bin_size;
-	particle_t* p_change;
-	for (int i = 0; i < bin_size; i++) {
-		particle_t* p = bins[i].phead;
-		while(p != NULL) {
-			int bidx = get_bin_pos(state, params, p->id);
-			if (bidx != i) {
-				p_change = p;
-				p = p->next;
-				p_change = remove_particle_from_bins(state, p_change->id, i);
-				put_particle_to_bins(state, params, p_change);
-			} else {
-				p = p->next;
-			}
-		}
+	int status = 1;
+#pragma omp parallel num_threads(state->arena.nthreads)
+	{
+		int st = update_bins_ws(state, params);
+#pragma omp master
+		status = st;
 	}
-	return 1;
+	return status;
 }
 
+/*@T
+ * \subsection{Renumbering}
+ *
+ * Rebinning keeps the particle numbers of each cell together, but the
+ * particle arrays are indexed by particle number, and particles that
+ * started out next to each other drift apart as the fluid moves.  Then
+ * the neighbor loops gather their data from all over memory.  The
+ * [[optimize_bins]] routine renumbers the particles in cell order, so
+ * that the particles of a cell and of its neighbors are close together
+ * again.  Particle [[bin_ids[k]]] becomes particle $k$, so every
+ * per-particle array [[a]] must become [[a[bin_ids[k]]]].  Rather than
+ * keep a spare array for the gather, we follow the cycles of the
+ * permutation and move all the arrays together, marking each slot of
+ * [[bin_ids]] as we fill it; at the end the lists are the identity.
+ * Particle numbers are not stable across calls, so nothing may hold on
+ * to one.
+ *@c*/
+#define NFIELDS 14
+#define FIELD_BYTES sizeof(float)  /* Every field is a float or an int */
+
 int optimize_bins(sim_state_t* state, sim_param_t* params, int first_time){
-	bin_t* bins = state->bins;
 	int n = state->n;
-	int idx = 0;
-	particle_t* ps_new = (particle_t*) calloc(n, sizeof(particle_t));
+	int* ids = state->bin_ids;
+	if (state->bin_start[state->bin_size] != n)
+		return -1;
 
-	int bin_size = state->bin_size;
-	for (int b = 0; b < bin_size; b++) {
-		particle_t* p = bins[b].phead;
+	void* all[] = { state->rho, state->x, state->y,
+	                state->vhx, state->vhy, state->vx, state->vy,
+	                state->ax, state->ay, state->m, state->hs,
+	                state->p, state->nnb, state->arena.cell };
+	char* f[NFIELDS];
+	int nf = 0;
+	for (int k = 0; k < NFIELDS; ++k)
+		if (all[k] != NULL)
+			f[nf++] = (char*) all[k];
 
-		particle_t* prev = NULL;
-
-		if (p ==  NULL) bins[b].phead = NULL;
-		else bins[b].phead = &ps_new[idx];
-
-		while (p != NULL) {
-			deep_copy(p, &ps_new[idx]);
-			p = p->next;
-			if (prev != NULL)
-				ps_new[idx-1].next = &ps_new[idx];
-			prev = p;
-			idx = idx + 1;
+	for (int k = 0; k < n; ++k) {
+		if (ids[k] < 0 || ids[k] == k)
+			continue;
+		char save[NFIELDS*FIELD_BYTES];
+		for (int c = 0; c < nf; ++c)
+			memcpy(save + c*FIELD_BYTES, f[c] + k*FIELD_BYTES, FIELD_BYTES);
+		int j = k;
+		while (ids[j] != k) {
+			int src = ids[j];
+			for (int c = 0; c < nf; ++c)
+				memcpy(f[c] + j*FIELD_BYTES, f[c] + src*FIELD_BYTES, FIELD_BYTES);
+			ids[j] = -1;
+			j = src;
 		}
+		for (int c = 0; c < nf; ++c)
+			memcpy(f[c] + j*FIELD_BYTES, save + c*FIELD_BYTES, FIELD_BYTES);
+		ids[j] = -1;
 	}
-	free(state->ps);
-	state->ps = ps_new;
+	for (int k = 0; k < n; ++k)
+		ids[k] = k;
 	return 1;
 }
-
-void deep_copy(particle_t* p_old, particle_t* p_new) {
-	p_new->x_idx = p_old->x_idx;
-	p_new->y_idx = p_old->y_idx;
-	p_new->id = p_old->id;
-	p_new->next = NULL;
-}
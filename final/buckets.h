@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include "params.h"
 #include "state.h"
 
@@ -5,19 +6,42 @@ int get_bin_pos(sim_state_t* state, sim_param_t* params, int id);
 
 void build_bins(sim_state_t* state, sim_param_t* params);
 
-void init_bins(bin_t* bins, int bin_size);
-
-particle_t* get_particle_from_bins(sim_state_t* state, sim_param_t* params, int particle_id);
-
-void put_particle_to_bins(sim_state_t* state, sim_param_t* params, particle_t* p);
-
-particle_t* remove_particle_from_bins(sim_state_t* state, int particle_id, int bidx);
-
 int update_bins(sim_state_t* state, sim_param_t* params);
 
-int optimize_bins(sim_state_t* state, sim_param_t* params, int first_time);
-
-void deep_copy(particle_t* p_old, particle_t* p_new);
+int update_bins_ws(sim_state_t* state, sim_param_t* params);
 
-void neighbors3(sim_state_t* state, sim_param_t* param, int bidx, particle_t* p, int* nns4);
+int optimize_bins(sim_state_t* state, sim_param_t* params, int first_time);
 
+void neighbors3(sim_state_t* state, sim_param_t* param, int bidx, int* nns4);
+
+void neighbor_cells(sim_state_t* state, sim_param_t* param, int cell, int* nns4);
+
+/* Slot where the search for a grid cell starts in the sparse grid's
+ * hash table: rows are scattered, cells within a row stay adjacent. */
+static inline unsigned cell_hash(const sim_state_t* state, int cell)
+{
+    unsigned ix = cell % state->MAX;
+    unsigned iy = cell / state->MAX;
+    return (iy * 2654435761u + ix) & (state->hash.cap - 1);
+}
+
+/* Bin of a grid cell, or -1 if the sparse grid has no bin for it */
+static inline int cell_bin(const sim_state_t* state, int cell)
+{
+    if (state->bin_key == NULL)
+        return cell;
+    const int* slots = state->hash.slots;
+    unsigned mask = state->hash.cap - 1;
+    for (unsigned k = cell_hash(state, cell); ; k = (k+1) & mask) {
+        if (slots[2*k] == cell)
+            return slots[2*k+1];
+        if (slots[2*k] == -1)
+            return -1;
+    }
+}
+
+/* Grid cell of a bin */
+static inline int bin_cell(const sim_state_t* state, int b)
+{
+    return state->bin_key ? state->bin_key[b] : b;
+}
@@ -0,0 +1,68 @@
+#include <string.h>
+#include <math.h>
+
+#include "params.h"
+#include "state.h"
+#include "channel.h"
+
+/*@T
+ *
+ * The ranges are fixed for the whole run, so colors mean the same
+ * thing in every frame.  The fluid is nearly incompressible, so
+ * densities are shown within ten percent of [[rho0]], and pressures
+ * over the matching range of compression (tension shows as zero).
+ * Speeds go up to that of a particle dropped from the top of the box,
+ * and neighbor counts (about four on the initial lattice) are one
+ * bucket per count up to 16.
+ *@c*/
+static const char* channel_names[] = {
+    "none", "density", "speed", "pressure", "neighbors"
+};
+#define NCHANNELS ((int) (sizeof(channel_names)/sizeof(channel_names[0])))
+
+int channel_lookup(const char* name)
+{
+    for (int i = 0; i < NCHANNELS; ++i)
+        if (strcmp(name, channel_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+static int quantize(float v, float lo, float hi)
+{
+    int q = (int) (256 * (v-lo) / (hi-lo));
+    if (q < 0)   q = 0;
+    if (q > 255) q = 255;
+    return CHANNEL_BASE + q;
+}
+
+void channel_quantize(sim_state_t* s, sim_param_t* params, int* q)
+{
+    const int n = s->n;
+    const float rho0 = params->rho0;
+    const float k    = params->k;
+    const float vmax = sqrtf(2 * params->g);
+    switch (params->channel) {
+    case CHANNEL_DENSITY:
+        for (int i = 0; i < n; ++i)
+            q[i] = quantize(s->rho[i], 0.9f*rho0, 1.1f*rho0);
+        break;
+    case CHANNEL_SPEED:
+        for (int i = 0; i < n; ++i)
+            q[i] = quantize(hypotf(s->vx[i], s->vy[i]), 0, vmax);
+        break;
+    case CHANNEL_PRESSURE:
+        for (int i = 0; i < n; ++i)
+            q[i] = quantize(s->p ? s->p[i] : k * (s->rho[i]-rho0),
+                            0, 0.1f*k*rho0);
+        break;
+    case CHANNEL_NEIGHBORS:
+        for (int i = 0; i < n; ++i)
+            q[i] = quantize(s->nnb[i], 0, 16);
+        break;
+    default:
+        for (int i = 0; i < n; ++i)
+            q[i] = 0;
+        break;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{Output channels}
+ *
+ * A channel is a per-particle quantity written into the color slot of
+ * each frame record.  Values are quantized onto $0..255$ over a fixed
+ * range per channel and offset by [[CHANNEL_BASE]], so the viewer can
+ * tell a channel value from the plain colors $0$ and $1$ and draw it
+ * on a color ramp.  The quantities come from arrays the time step
+ * already fills: densities from the density pass, velocities from
+ * the integrator, and neighbor counts, which the density pass records
+ * when [[params->channel]] asks for them.
+ *@c*/
+#define CHANNEL_BASE 256
+
+enum {
+    CHANNEL_NONE,
+    CHANNEL_DENSITY,
+    CHANNEL_SPEED,
+    CHANNEL_PRESSURE,
+    CHANNEL_NEIGHBORS
+};
+
+int  channel_lookup(const char* name);
+void channel_quantize(sim_state_t* s, sim_param_t* params, int* q);
+
+/*@q*/
+#endif /* CHANNEL_H */
@@ -9,6 +9,7 @@
 #include "interact.h"
 #include <stdio.h>
 #include "buckets.h"
+#include "perfctr.h"
 
 /*@q
  * ====================================================================
@@ -21,57 +22,100 @@
  * \[
  *   \rho_i = \frac{4m}{\pi h^8} \sum_{j \in N_i} (h^2 - r^2)^3.
  * \]
- * We search for neighbors of node $i$ by checking every particle,
- * which is not very efficient.  We do at least take advange of
- * the symmetry of the update ($i$ contributes to $j$ in the same
- * way that $j$ contributes to $i$).
+ * The [[density_cell]] routine computes the densities of the
+ * particles in one occupied cell [[b]], looking for neighbors only in
+ * the bins of its $3 \times 3$ stencil [[nns4]], which the rebinning
+ * sort stores with the cell in [[active.nbrs]].  Each particle gathers
+ * the sum for itself and writes only its own density, so the cells
+ * can be swept in any order, on any thread, with no atomics; this
+ * does each pair twice instead of using the symmetry of the update,
+ * which is cheaper than making the scattered writes safe.
  *@c*/
 
-void compute_density(sim_state_t* s, sim_param_t* params)
+void density_cell(sim_state_t* s, sim_param_t* params, int b,
+                  const int* nns4)
 {
-    const int n = s->n;
     float* restrict rho = s->rho;
     const float* restrict x = s->x;
+    const float* restrict y = s->y;
     const float h  = params->h;
     float h2 = h*h;
     float h8 = ( h2*h2 )*( h2*h2 );
     float C  = 4 * s->mass / M_PI / h8;
-    const int BIN_SIZE = s->bin_size;
-
-    memset(rho, 0, n*sizeof(float));
-    bin_t* bins = s->bins;
-
-#pragma omp parallel shared(bins, rho, h2, C, params, s, x)
-	 {
-		 int nns4[9];
-#pragma omp for schedule(static)
-		 for (int b = 0; b < BIN_SIZE; b++) {
-			 particle_t* pi = bins[b].phead;
-			 while (pi != NULL) {
-				 rho[pi->id] += 4 * s->mass / M_PI / h2;
-				 neighbors3(s, params, b, pi, nns4);
-				 for (int i = 0; i < 9; ++i) {
-					 int bj = nns4[i];
-					 if (bj == -1) continue;
-					 particle_t* pj = bins[bj].phead;
-					 while (pj != NULL) {
-						 if (pj->id != pi->id) {
-							 float dx = x[pi->x_idx]-x[pj->x_idx];
-							 float dy = x[pi->y_idx]-x[pj->y_idx];
-							 float r2 = dx*dx + dy*dy;
-							 float z  = h2-r2;
-							 if (z > 0) {
-								 float rho_ij = C*z*z*z;
-								 rho[pi->id] += rho_ij;
-							 }
-						 }
-						 pj = pj->next;
+    const int px = params->periodic & PERIODIC_X;
+    const int py = params->periodic & PERIODIC_Y;
+    const int* restrict start = s->bin_start;
+    const int* restrict ids = s->bin_ids;
+    long long spread = 0, pairs = 0;
+
+	 for (int ki = start[b]; ki < start[b+1]; ++ki) {
+		 const int i = ids[ki];
+		 float rhoi = 4 * s->mass / M_PI / h2;
+		 int nbi = 0;
+		 for (int c = 0; c < 9; ++c) {
+			 int bj = nns4[c];
+			 if (bj == -1) continue;
+			 for (int kj = start[bj]; kj < start[bj+1]; ++kj) {
+				 const int j = ids[kj];
+				 if (j == i) continue;
+				 float dx = min_image(x[i]-x[j], px);
+				 float dy = min_image(y[i]-y[j], py);
+				 float r2 = dx*dx + dy*dy;
+				 float z  = h2-r2;
+				 if (z > 0) {
+					 float rho_ij = C*z*z*z;
+					 rhoi += rho_ij;
+					 if (bj == b) {
+						 spread += abs(i - j);
+						 ++pairs;
 					 }
+					 ++nbi;
 				 }
-				 pi = pi->next;
 			 }
 		 }
+		 rho[i] = rhoi;
+		 if (s->nnb)
+			 s->nnb[i] = nbi;
 	 }
+	 if (pairs) {
+#pragma omp atomic
+		 s->spread += spread;
+#pragma omp atomic
+		 s->pairs += pairs;
+	 }
+}
+
+/*@T
+ *
+ * The whole-grid sweeps walk only the occupied cells, in the order of
+ * [[active.cells]], handing each one its stencil from [[active.nbrs]];
+ * a static schedule over that list gives every thread about the same
+ * number of cells.  They contain only orphaned worksharing, so the
+ * step engine in [[step.c]] can call the [[_ws]] versions from inside
+ * its one parallel region; [[compute_density]] and [[compute_accel]]
+ * wrap them in a region of their own for everyone else.  Each sweep
+ * ends with a barrier, since the next phase reads what it wrote.
+ *@c*/
+void compute_density_ws(sim_state_t* s, sim_param_t* params)
+{
+    const int nactive = s->active.n;
+    const int* restrict cells = s->active.cells;
+    const int* restrict nbrs  = s->active.nbrs;
+    void (*cell)(sim_state_t*, sim_param_t*, int, const int*) =
+        s->m ? density_cell_adaptive : density_cell;
+
+	 perf_begin(PHASE_DENSITY);
+#pragma omp for schedule(static) nowait
+	 for (int ka = 0; ka < nactive; ka++)
+		 cell(s, params, cells[ka], nbrs + 9*ka);
+	 perf_end(PHASE_DENSITY);
+#pragma omp barrier
+}
+
+void compute_density(sim_state_t* s, sim_param_t* params)
+{
+#pragma omp parallel
+	 compute_density_ws(s, params);
 }
 
 /*@T
@@ -83,13 +127,15 @@ void compute_density(sim_state_t* s, sim_param_t* params)
  *     \bff_{ij}^{\mathrm{interact}} + \bfg,
  * \]
  * where the pair interaction formula is as previously described.
- * Like [[compute_density]], the [[compute_accel]] routine takes
- * advantage of the symmetry of the interaction forces
- * ($\bff_{ij}^{\mathrm{interact}} = -\bff_{ji}^{\mathrm{interact}}$)
- * but it does a very expensive brute force search for neighbors.
+ * Like [[density_cell]], the [[accel_cell]] routine gathers over the
+ * $3 \times 3$ stencil of one occupied cell and writes only the
+ * accelerations of that cell's particles, rather than using
+ * $\bff_{ij}^{\mathrm{interact}} = -\bff_{ji}^{\mathrm{interact}}$
+ * to add each pair force to both particles.
  *@c*/
 
-void compute_accel(sim_state_t* state, sim_param_t* params)
+void accel_cell(sim_state_t* state, sim_param_t* params, int b,
+                const int* nns4)
 {
     // Unpack basic parameters
     const float h    = params->h;
@@ -99,65 +145,85 @@ void compute_accel(sim_state_t* state, sim_param_t* params)
     const float g    = params->g;
     const float mass = state->mass;
     const float h2   = h*h;
+    const int   px   = params->periodic & PERIODIC_X;
+    const int   py   = params->periodic & PERIODIC_Y;
     
     // Unpack system state
     const float* restrict rho = state->rho;
     const float* restrict x   = state->x;
-    const float* restrict v   = state->v;
-    float* restrict a         = state->a;
-    int n = state->n;
-    // Compute density and color
-    compute_density(state, params);
-
-    // Start with gravity and surface forces
-    for (int j = 0; j < n; ++j) {
-        a[2*j+0] = 0;
-        a[2*j+1] = -g;
-    }
+    const float* restrict y   = state->y;
+    const float* restrict vx  = state->vx;
+    const float* restrict vy  = state->vy;
+    float* restrict ax        = state->ax;
+    float* restrict ay        = state->ay;
 
 	 // Constants for interaction term
 	 float C0 = mass / M_PI / ( (h2)*(h2) );
 	 float Cp =  15*k;
 	 float Cv = -40*mu;
-	 // Now compute interaction forces
-	 int BIN_SIZE = state->bin_size;
-
-	 bin_t* bins = state->bins;
-#pragma omp parallel shared(bins, BIN_SIZE, n, rho, x, v, a, state, params)
-	 {
-		 int nns4[9];
-#pragma omp for schedule(static)
-		 for (int b = 0; b < BIN_SIZE; ++b) {
-			 particle_t* pi = bins[b].phead;
-			 while (pi != NULL) {
-				 const float rhoi = rho[pi->id];
-				 neighbors3(state, params, b, pi, nns4);
-				 for (int i = 0; i < 9; ++i) {
-					 int bj = nns4[i];
-					 if (bj == -1) continue;
-					 particle_t* pj = bins[bj].phead;
-					 while (pj != NULL) {
-						 if (pj->id == pi->id) {pj = pj->next; continue;}
-						 float dx = x[pi->x_idx]-x[pj->x_idx];
-						 float dy = x[pi->y_idx]-x[pj->y_idx];
-						 float r2 = dx*dx + dy*dy;
-						 if (r2 < h2) {
-							 const float rhoj = rho[pj->id];
-							 float q = sqrt(r2)/h;
-							 float u = 1-q;
-							 float w0 = C0 * u/rhoi/rhoj;
-							 float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
-							 float wv = w0 * Cv;
-							 float dvx = v[pi->x_idx]-v[pj->x_idx];
-							 float dvy = v[pi->y_idx]-v[pj->y_idx];
-							 a[pi->x_idx] += (wp*dx + wv*dvx);
-							 a[pi->y_idx] += (wp*dy + wv*dvy);
-						 }
-						 pj = pj->next;
-					 }
+
+	 const int* restrict start = state->bin_start;
+	 const int* restrict ids = state->bin_ids;
+	 for (int ki = start[b]; ki < start[b+1]; ++ki) {
+		 const int i = ids[ki];
+		 const float rhoi = rho[i];
+		 // Start with gravity and surface forces
+		 float axi = 0;
+		 float ayi = -g;
+		 for (int c = 0; c < 9; ++c) {
+			 int bj = nns4[c];
+			 if (bj == -1) continue;
+			 for (int kj = start[bj]; kj < start[bj+1]; ++kj) {
+				 const int j = ids[kj];
+				 if (j == i) continue;
+				 float dx = min_image(x[i]-x[j], px);
+				 float dy = min_image(y[i]-y[j], py);
+				 float r2 = dx*dx + dy*dy;
+				 if (r2 < h2) {
+					 const float rhoj = rho[j];
+					 float q = sqrt(r2)/h;
+					 float u = 1-q;
+					 float w0 = C0 * u/rhoi/rhoj;
+					 float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
+					 float wv = w0 * Cv;
+					 float dvx = vx[i]-vx[j];
+					 float dvy = vy[i]-vy[j];
+					 axi += (wp*dx + wv*dvx);
+					 ayi += (wp*dy + wv*dvy);
 				 }
-				 pi = pi->next;
 			 }
 		 }
+		 ax[i] = axi;
+		 ay[i] = ayi;
 	 }
 }
+
+void compute_accel_ws(sim_state_t* state, sim_param_t* params)
+{
+    const int nactive = state->active.n;
+    const int* restrict cells = state->active.cells;
+    const int* restrict nbrs  = state->active.nbrs;
+    void (*cell)(sim_state_t*, sim_param_t*, int, const int*) =
+        state->m ? accel_cell_adaptive : accel_cell;
+
+    if (params->implicit > 0) {
+        compute_accel_implicit_ws(state, params);
+        return;
+    }
+
+    // Compute density and color
+    compute_density_ws(state, params);
+
+	 perf_begin(PHASE_FORCE);
+#pragma omp for schedule(static) nowait
+	 for (int ka = 0; ka < nactive; ++ka)
+		 cell(state, params, cells[ka], nbrs + 9*ka);
+	 perf_end(PHASE_FORCE);
+#pragma omp barrier
+}
+
+void compute_accel(sim_state_t* state, sim_param_t* params)
+{
+#pragma omp parallel
+	 compute_accel_ws(state, params);
+}
@@ -4,7 +4,48 @@
 #include "params.h"
 #include "state.h"
 
+/*@T
+ * \section{Interactions}
+ *
+ * In a periodic direction, particles interact with the nearest
+ * periodic image of their neighbors.  The domain is the unit box, so
+ * [[min_image]] just shifts a coordinate difference into $[-1/2, 1/2]$.
+ *@c*/
+static inline float min_image(float d, int periodic)
+{
+    if (periodic) {
+        if (d > 0.5f)  d -= 1;
+        if (d < -0.5f) d += 1;
+    }
+    return d;
+}
+
 void compute_density(sim_state_t* s, sim_param_t* params);
 void compute_accel(sim_state_t* state, sim_param_t* params);
 
+/* The same, called by every thread of an enclosing parallel region */
+void compute_density_ws(sim_state_t* s, sim_param_t* params);
+void compute_accel_ws(sim_state_t* state, sim_param_t* params);
+
+/* One cell's particles, given the neighbor bins from [[neighbors3]];
+ * the whole-grid routines loop over these for the occupied cells */
+void density_cell(sim_state_t* s, sim_param_t* params, int b,
+                  const int* nns4);
+void accel_cell(sim_state_t* state, sim_param_t* params, int b,
+                const int* nns4);
+
+/* Per-particle mass and h versions (interact_adaptive.c) */
+void density_cell_adaptive(sim_state_t* s, sim_param_t* params, int b,
+                           const int* nns4);
+void accel_cell_adaptive(sim_state_t* state, sim_param_t* params, int b,
+                         const int* nns4);
+
+/* Iterative incompressible pressure solve (interact_implicit.c) */
+void compute_accel_implicit_ws(sim_state_t* s, sim_param_t* params);
+
+/* All-pairs reference kernels (interact_ref.c), used for validation */
+void compute_density_ref(sim_state_t* s, sim_param_t* params);
+void compute_accel_ref(sim_state_t* state, sim_param_t* params);
+
+/*@q*/
 #endif /* INTERACT_H */
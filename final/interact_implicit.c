@@ -0,0 +1,242 @@
+#include <math.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "buckets.h"
+#include "perfctr.h"
+
+/*@T
+ * \subsection{Implicit pressure}
+ *
+ * The weakly compressible pressure $p = k(\rho-\rho_0)$ keeps the
+ * fluid within a few percent of [[rho0]] only if $k$ is large, and a
+ * stiff $k$ forces a short time step.  With [[params->implicit]] set,
+ * we instead solve for the pressures that make the {\em next} step
+ * come out at [[rho0]], in the style of IISPH.  The pressure force is
+ * the one [[accel_cell]] uses, with $k(\rho_i+\rho_j-2\rho_0)$
+ * replaced by $p_i+p_j$:
+ * \[
+ *   \bfa^p_i = \sum_j (p_i+p_j) G_{ij} \bfr_{ij}, \quad
+ *   G_{ij} = \frac{15 m}{\pi h^4} \frac{(1-q_{ij})^2}{q_{ij} \rho_i \rho_j}.
+ * \]
+ * The next leapfrog step moves the particles with
+ * $\bfv^{i+1/2} = \bfv^{i-1/2} + (\bfa^{np} + \bfa^p) \Delta t$, where
+ * $\bfa^{np}$ is viscosity and gravity, so to first order the density
+ * after the step is
+ * \[
+ *   \rho^*_i = \rho_i + \Delta t \sum_j \nabla_i W_{ij} \cdot
+ *     (\bfv^{i+1/2}_i - \bfv^{i+1/2}_j), \quad
+ *   \nabla_i W_{ij} = -\frac{24 m}{\pi h^8} (h^2-r_{ij}^2)^2 \bfr_{ij}.
+ * \]
+ * Each iteration is two gather-only sweeps over the cells: one for
+ * $\bfa^p$ from the current pressures, and one that predicts
+ * $\rho^*_i$.  If no particle is compressed by more than
+ * [[params->implicit]] times [[rho0]], we stop; otherwise a relaxed
+ * Jacobi update moves each pressure toward the value that would
+ * remove its particle's compression,
+ * \[
+ *   p_i \leftarrow \max\left(0,
+ *     p_i + \omega \frac{\rho^*_i-\rho_0}{\Delta t^2 A_i}\right),
+ * \]
+ * and we go around again, for at most [[IMPLICIT_MAX_ITERS]] updates.
+ * Here $\Delta t^2 A_i$ is how much a unit pressure on particle $i$
+ * alone lowers its own predicted density (the diagonal of the IISPH
+ * system),
+ * \[
+ *   A_i = -\Big(\sum_j \nabla_i W_{ij}\Big) \cdot
+ *           \Big(\sum_j G_{ij} \bfr_{ij}\Big)
+ *         - \sum_j G_{ij} \nabla_i W_{ij} \cdot \bfr_{ij},
+ * \]
+ * which the prediction sweep adds up along the way; $\omega = 1/2$
+ * makes up for the neighbors pushing at the same time.  Pressures
+ * never go negative, so a free surface does not pull the fluid apart.
+ * Each step starts from the last step's pressures, which usually
+ * leaves only a few updates to do.  The largest compression is a
+ * maximum, not a sum, so the iteration count and the results do not
+ * depend on the number of threads.
+ *
+ * Without a stiff $k$, the time step is limited by how far a particle
+ * may move in one step instead.  The dam break runs stably at ten
+ * times the default time step ([[-t 1e-3 -f 10 -i 0.01]]), with
+ * about ten updates per step.
+ *@c*/
+#define IMPLICIT_MAX_ITERS 50
+#define IMPLICIT_OMEGA     0.5f
+
+static void pressure_accel_cell(sim_state_t* s, sim_param_t* params, int b,
+                                const int* nns)
+{
+    const float h  = params->h;
+    const float h2 = h*h;
+    const float C0 = 15 * s->mass / M_PI / (h2*h2);
+    const int   px = params->periodic & PERIODIC_X;
+    const int   py = params->periodic & PERIODIC_Y;
+    const float* restrict rho = s->rho;
+    const float* restrict x   = s->x;
+    const float* restrict y   = s->y;
+    const float* restrict p   = s->p;
+    float* restrict apx = s->apx;
+    float* restrict apy = s->apy;
+    const int* restrict start = s->bin_start;
+    const int* restrict ids   = s->bin_ids;
+
+    for (int ki = start[b]; ki < start[b+1]; ++ki) {
+        const int i = ids[ki];
+        float axi = 0, ayi = 0;
+        for (int c = 0; c < 9; ++c) {
+            int bj = nns[c];
+            if (bj == -1) continue;
+            for (int kj = start[bj]; kj < start[bj+1]; ++kj) {
+                const int j = ids[kj];
+                if (j == i) continue;
+                float dx = min_image(x[i]-x[j], px);
+                float dy = min_image(y[i]-y[j], py);
+                float r2 = dx*dx + dy*dy;
+                if (r2 < h2) {
+                    float q = sqrtf(r2)/h;
+                    float u = 1-q;
+                    float w = C0 * (p[i]+p[j]) * u*u / q / rho[i] / rho[j];
+                    axi += w*dx;
+                    ayi += w*dy;
+                }
+            }
+        }
+        apx[i] = axi;
+        apy[i] = ayi;
+    }
+}
+
+static float residual_cell(sim_state_t* s, sim_param_t* params, int b,
+                           const int* nns)
+{
+    const float h   = params->h;
+    const float h2  = h*h;
+    const float dt  = params->dt;
+    const float rho0 = params->rho0;
+    const float C   = -24 * s->mass / M_PI / ((h2*h2)*(h2*h2));
+    const float C0  = 15 * s->mass / M_PI / (h2*h2);
+    const int   px  = params->periodic & PERIODIC_X;
+    const int   py  = params->periodic & PERIODIC_Y;
+    const float* restrict rho = s->rho;
+    const float* restrict x   = s->x;
+    const float* restrict y   = s->y;
+    const float* restrict vhx = s->vhx;
+    const float* restrict vhy = s->vhy;
+    const float* restrict ax  = s->ax;
+    const float* restrict ay  = s->ay;
+    const float* restrict apx = s->apx;
+    const float* restrict apy = s->apy;
+    float* restrict res = s->res;
+    const int* restrict start = s->bin_start;
+    const int* restrict ids   = s->bin_ids;
+    float err = 0;
+
+    for (int ki = start[b]; ki < start[b+1]; ++ki) {
+        const int i = ids[ki];
+        float vxi = vhx[i] + dt*(ax[i]+apx[i]);
+        float vyi = vhy[i] + dt*(ay[i]+apy[i]);
+        float drho = 0, diag = 0;
+        float gwx = 0, gwy = 0, gpx = 0, gpy = 0;
+        for (int c = 0; c < 9; ++c) {
+            int bj = nns[c];
+            if (bj == -1) continue;
+            for (int kj = start[bj]; kj < start[bj+1]; ++kj) {
+                const int j = ids[kj];
+                if (j == i) continue;
+                float dx = min_image(x[i]-x[j], px);
+                float dy = min_image(y[i]-y[j], py);
+                float r2 = dx*dx + dy*dy;
+                float z  = h2-r2;
+                if (z > 0) {
+                    float dvx = vxi - (vhx[j] + dt*(ax[j]+apx[j]));
+                    float dvy = vyi - (vhy[j] + dt*(ay[j]+apy[j]));
+                    float w = C * z*z;
+                    float q = sqrtf(r2)/h;
+                    float G = C0 * (1-q)*(1-q) / q / rho[i] / rho[j];
+                    drho += w * (dx*dvx + dy*dvy);
+                    diag += w * G * r2;
+                    gwx += w*dx;  gwy += w*dy;
+                    gpx += G*dx;  gpy += G*dy;
+                }
+            }
+        }
+        float e = rho[i] + dt*drho - rho0;
+        float A = -(diag + gwx*gpx + gwy*gpy);
+        res[i] = (A > 0) ? e/A : 0;
+        if (e > err)
+            err = e;
+    }
+    return err;
+}
+
+/*@T
+ *
+ * Like the other sweeps, [[compute_accel_implicit_ws]] uses only
+ * orphaned worksharing.  The non-pressure accelerations come from the
+ * ordinary force kernel with $k = 0$; the pressure accelerations are
+ * added to them once the iteration stops.
+ *@c*/
+void compute_accel_implicit_ws(sim_state_t* s, sim_param_t* params)
+{
+    const int nactive = s->active.n;
+    const int* restrict cells = s->active.cells;
+    const int* restrict nbrs  = s->active.nbrs;
+    const int n = s->n;
+    const float dt = params->dt;
+    const float tol = params->implicit * params->rho0;
+    sim_param_t p0 = *params;
+    p0.k = 0;
+
+    compute_density_ws(s, params);
+
+    perf_begin(PHASE_FORCE);
+#pragma omp for schedule(static) nowait
+    for (int ka = 0; ka < nactive; ++ka)
+        accel_cell(s, &p0, cells[ka], nbrs + 9*ka);
+    perf_end(PHASE_FORCE);
+#pragma omp barrier
+
+    perf_begin(PHASE_PRESSURE);
+    const float scale = IMPLICIT_OMEGA / (dt*dt);
+    float* restrict p   = s->p;
+    const float* restrict res = s->res;
+    for (int it = 0; ; ++it) {
+#pragma omp for schedule(static) nowait
+        for (int ka = 0; ka < nactive; ++ka)
+            pressure_accel_cell(s, params, cells[ka], nbrs + 9*ka);
+#pragma omp single nowait
+        s->perr = 0;
+        perf_barrier(PHASE_PRESSURE);
+        float err = 0;
+#pragma omp for schedule(static) nowait
+        for (int ka = 0; ka < nactive; ++ka) {
+            float e = residual_cell(s, params, cells[ka], nbrs + 9*ka);
+            if (e > err)
+                err = e;
+        }
+#pragma omp critical
+        if (err > s->perr)
+            s->perr = err;
+        perf_barrier(PHASE_PRESSURE);
+        if (s->perr <= tol || it == IMPLICIT_MAX_ITERS)
+            break;
+
+#pragma omp for schedule(static) nowait
+        for (int i = 0; i < n; ++i) {
+            float pi = p[i] + scale*res[i];
+            p[i] = pi > 0 ? pi : 0;
+        }
+#pragma omp single nowait
+        s->iters++;
+        perf_barrier(PHASE_PRESSURE);
+    }
+
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; ++i) {
+        s->ax[i] += s->apx[i];
+        s->ay[i] += s->apy[i];
+    }
+    perf_end(PHASE_PRESSURE);
+#pragma omp barrier
+}
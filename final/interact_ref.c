@@ -0,0 +1,138 @@
+#include <string.h>
+#include <math.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+
+/*@T
+ * \subsection{Reference kernels}
+ *
+ * The [[compute_density_ref]] and [[compute_accel_ref]] routines are
+ * the original all-pairs kernels from the serial code.  They check
+ * every pair of particles, so they are far too slow for production
+ * runs, but they are simple enough to trust: the validation driver
+ * uses them as the oracle for the binned and otherwise optimized
+ * kernels.  They take advantage of the symmetry of the interactions,
+ * so they are also a useful check that the gather form of the
+ * optimized kernels sees exactly the same neighbor pairs.
+ *@c*/
+void compute_density_ref(sim_state_t* s, sim_param_t* params)
+{
+    int n = s->n;
+    float* restrict rho = s->rho;
+    const float* restrict x = s->x;
+    const float* restrict y = s->y;
+
+    float h  = params->h;
+    float h2 = h*h;
+    int   px = params->periodic & PERIODIC_X;
+    int   py = params->periodic & PERIODIC_Y;
+    float h8 = ( h2*h2 )*( h2*h2 );
+    float C  = 4 * s->mass / M_PI / h8;
+
+    memset(rho, 0, n*sizeof(float));
+    for (int i = 0; i < n; ++i) {
+        if (s->m) {
+            h2 = s->hs[i]*s->hs[i];
+            rho[i] += 4 * s->m[i] / M_PI / h2;
+        } else {
+            rho[i] += 4 * s->mass / M_PI / h2;
+        }
+        for (int j = i+1; j < n; ++j) {
+            float dx = min_image(x[i]-x[j], px);
+            float dy = min_image(y[i]-y[j], py);
+            float r2 = dx*dx + dy*dy;
+            if (s->m) {
+                float hij = (s->hs[i] + s->hs[j]) / 2;
+                h2 = hij*hij;
+                h8 = ( h2*h2 )*( h2*h2 );
+            }
+            float z  = h2-r2;
+            if (z > 0) {
+                if (s->m) {
+                    rho[i] += 4 * s->m[j] / M_PI / h8 * z*z*z;
+                    rho[j] += 4 * s->m[i] / M_PI / h8 * z*z*z;
+                    continue;
+                }
+                float rho_ij = C*z*z*z;
+                rho[i] += rho_ij;
+                rho[j] += rho_ij;
+            }
+        }
+    }
+}
+
+void compute_accel_ref(sim_state_t* state, sim_param_t* params)
+{
+    // Unpack basic parameters
+    const float h    = params->h;
+    const float rho0 = params->rho0;
+    const float k    = params->k;
+    const float mu   = params->mu;
+    const float g    = params->g;
+    const float mass = state->mass;
+    const float h2   = h*h;
+    const int   px   = params->periodic & PERIODIC_X;
+    const int   py   = params->periodic & PERIODIC_Y;
+
+    // Unpack system state
+    const float* restrict rho = state->rho;
+    const float* restrict x   = state->x;
+    const float* restrict y   = state->y;
+    const float* restrict vx  = state->vx;
+    const float* restrict vy  = state->vy;
+    float* restrict ax        = state->ax;
+    float* restrict ay        = state->ay;
+    int n = state->n;
+
+    // Compute density and color
+    compute_density_ref(state, params);
+
+    // Start with gravity and surface forces
+    for (int i = 0; i < n; ++i) {
+        ax[i] = 0;
+        ay[i] = -g;
+    }
+
+    // Constants for interaction term
+    float C0 = mass / M_PI / ( (h2)*(h2) );
+    float Cp =  15*k;
+    float Cv = -40*mu;
+
+    // Now compute interaction forces
+    for (int i = 0; i < n; ++i) {
+        const float rhoi = rho[i];
+        for (int j = i+1; j < n; ++j) {
+            float dx = min_image(x[i]-x[j], px);
+            float dy = min_image(y[i]-y[j], py);
+            float r2 = dx*dx + dy*dy;
+            float hij = state->m ? (state->hs[i] + state->hs[j]) / 2 : h;
+            if (r2 < hij*hij) {
+                const float rhoj = rho[j];
+                float q = sqrt(r2)/hij;
+                float u = 1-q;
+                float w0 = u/rhoi/rhoj;
+                float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
+                float wv = w0 * Cv;
+                float dvx = vx[i]-vx[j];
+                float dvy = vy[i]-vy[j];
+                float fx = (wp*dx + wv*dvx);
+                float fy = (wp*dy + wv*dvy);
+                if (state->m) {
+                    // Variable resolution: C0 uses h_ij and the other mass
+                    float c = 1 / M_PI / ((hij*hij)*(hij*hij));
+                    ax[i] += c * state->m[j] * fx;
+                    ay[i] += c * state->m[j] * fy;
+                    ax[j] -= c * state->m[i] * fx;
+                    ay[j] -= c * state->m[i] * fy;
+                } else {
+                    ax[i] += C0 * fx;
+                    ay[i] += C0 * fy;
+                    ax[j] -= C0 * fx;
+                    ay[j] -= C0 * fy;
+                }
+            }
+        }
+    }
+}
@@ -1,7 +1,31 @@
 #ifndef IO_H
 #define IO_H
 
-void write_header(FILE* fp, int n);
-void write_frame_data(FILE* fp, int n, float* x, int* c);
+#include <stdio.h>
+#include <string.h>
+
+/* An output format: binary (io_bin.c) or text (io_txt.c), picked at
+ * run time by name */
+typedef struct io_format_t {
+    const char* name;
+    void (*write_header)(FILE* fp, int n);
+    void (*write_frame_data)(FILE* fp, int n, float* x, float* y, int* c);
+} io_format_t;
+
+extern const io_format_t io_bin;
+extern const io_format_t io_txt;
+
+/* Write v at s with the fewest digits that read back exactly, with no
+ * terminator, and return the end (io_txt.c) */
+char* io_put_float(char* s, float v);
+
+static inline const io_format_t* io_lookup(const char* name)
+{
+    if (strcmp(name, io_bin.name) == 0)
+        return &io_bin;
+    if (strcmp(name, io_txt.name) == 0)
+        return &io_txt;
+    return NULL;
+}
 
 #endif /* IO_H */
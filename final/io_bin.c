@@ -46,7 +46,7 @@ uint32_t htonf(void* data)
  * to be in the coordinate system of the simulation; right now, it is
  * always set to be 1 (i.e. the view box is $[0,1] \times [0,1]$)
  *@c*/
-void write_header(FILE* fp, int n)
+static void write_header(FILE* fp, int n)
 {
     float scale = 1.0;
     uint32_t nn = htonl((uint32_t) n);
@@ -63,15 +63,17 @@ void write_header(FILE* fp, int n)
  * $n_{\mathrm{particles}}$ pairs of 32-bit int floating point numbers
  * and an optional flag which is used to determine the color.
  * There are no markers, end tags, etc; just the raw data.
- * The [[write_frame_data]] routine writes $n$ point records;
+ * The [[write_frame_data]] routine writes $n$ point records,
+ * interleaving the separate [[x]] and [[y]] coordinate arrays of the
+ * simulation state into the on-disk layout;
  * note that writing a single frame of output may involve multiple
  * calls to [[write_frame_data]].
  *@c*/
-void write_frame_data(FILE* fp, int n, float* x, int* c)
+static void write_frame_data(FILE* fp, int n, float* x, float* y, int* c)
 {
     for (int i = 0; i < n; ++i) {
         uint32_t xi = htonf(x++);
-        uint32_t yi = htonf(x++);
+        uint32_t yi = htonf(y++);
         fwrite(&xi, sizeof(xi), 1, fp);
         fwrite(&yi, sizeof(yi), 1, fp);
         uint32_t ci0 = c ? *c++ : 0;
@@ -79,3 +81,10 @@ void write_frame_data(FILE* fp, int n, float* x, int* c)
         fwrite(&ci, sizeof(ci), 1, fp);
     }
 }
+
+/*@T
+ *
+ * The program picks its output format by name at run time, so each
+ * format exports its two writers under its name.
+ *@c*/
+const io_format_t io_bin = { "bin", write_header, write_frame_data };
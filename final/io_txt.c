@@ -1,21 +1,243 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
 #include "io.h"
 
+/*@T
+ * \section{Text output}
+ *
+ * Several downstream tools read the text format, in which every line
+ * of a frame holds one particle as $x$, $y$ and the color value.
+ * Formatting with [[fprintf]] is slow (it parses the format and
+ * consults the locale for every number), so we format the numbers
+ * ourselves into a buffer and write each frame with one [[fwrite]].
+ * Each float is written with the fewest significant digits that read
+ * back as exactly the same float, so the file is both shorter than
+ * with [[%e]] and exact; readers that use [[%g]] or Java's [[Scanner]]
+ * parse it as before.
+ *@c*/
 #define VERSION_TAG "SPHView00 "
 
 
-void write_header(FILE* fp, int n)
+static void write_header(FILE* fp, int n)
 {
     fprintf(fp, "%s%d 1\n", VERSION_TAG, n);
 }
 
+/*@T
+ * \subsection{Shortest round-trip floats}
+ *
+ * Nine significant digits always identify a float, so we look for the
+ * smallest $p \leq 9$ such that the $p$-digit decimal nearest to the
+ * value reads back as the same float.  If $p$ digits are enough, so
+ * are $p+1$, so a binary search over $p$ takes at most four tries.
+ * A try rounds $v \cdot 10^{p-1-e}$ to an integer $m$ in double
+ * precision, where $e$ is the decimal exponent of $v$, and converts
+ * $m \cdot 10^{e-p+1}$ back to a float.  The conversion back rounds
+ * twice (to double, then to float), which could differ from reading
+ * the decimal directly only when the double lands exactly halfway
+ * between two floats, so we count such a try as a failure.  If even
+ * nine digits fail that way, we leave the number to [[snprintf]].
+ * [[io_put_float]] is exported so that [[validate.x -O]] can check
+ * that every kind of float reads back with the same bits.
+ *@c*/
+static const double pow10_tab[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+    1e20, 1e21, 1e22
+};
 
-void write_frame_data(FILE* fp, int n, float* x, int* c)
+static double scale10(double v, int k)
 {
+    while (k > 22)  { v *= 1e22; k -= 22; }
+    while (k < -22) { v /= 1e22; k += 22; }
+    return k >= 0 ? v * pow10_tab[k] : v / pow10_tab[-k];
+}
+
+/* Nearest p-digit m with |v| ~ m 10^(e-p+1); 0 if it does not read back */
+static long long try_digits(float v, int e, int p, int* ep)
+{
+    double a = fabs((double) v);
+    long long m = (long long) (scale10(a, p-1-e) + 0.5);
+    if (m >= (long long) pow10_tab[p]) {
+        m = (long long) (scale10(a, p-2-e) + 0.5);
+        ++e;
+    } else if (m < (long long) pow10_tab[p-1]) {
+        m = (long long) (scale10(a, p-e) + 0.5);
+        --e;
+    }
+    double d = scale10((double) m, e-p+1);
+    float  f = (float) d;
+    if (f != fabsf(v))
+        return 0;
+    double half = (d >= f ? (double) nextafterf(f, INFINITY) - f
+                          : (double) f - nextafterf(f, 0)) / 2;
+    if (fabs(d - f) == half)
+        return 0;
+    *ep = e;
+    return m;
+}
+
+char* io_put_float(char* s, float v)
+{
+    if (v == 0) {
+        if (signbit(v))
+            *s++ = '-';
+        *s++ = '0';
+        return s;
+    }
+    if (!isfinite(v))
+        return s + sprintf(s, "%g", v);
+
+    // Decimal exponent from the binary one; try_digits fixes it up
+    int be;
+    frexp(v, &be);
+    int e = (int) floor((be-1) * 0.30102999566398120);
+    int lo = 1, hi = 9, e_best = 0;
+    long long m_best = 0;
+    while (lo <= hi) {
+        int p = (lo+hi)/2, ep;
+        long long m = try_digits(v, e, p, &ep);
+        if (m) {
+            m_best = m;
+            e_best = ep;
+            hi = p-1;
+        } else {
+            lo = p+1;
+        }
+    }
+    if (m_best == 0)
+        return s + sprintf(s, "%.9g", v);
+
+    // Digits of m without trailing zeros
+    char dig[20];
+    int nd = 0;
+    while (m_best % 10 == 0)
+        m_best /= 10;
+    for (long long t = m_best; t > 0; t /= 10)
+        dig[nd++] = '0' + t % 10;
+    e = e_best;
+
+    if (v < 0)
+        *s++ = '-';
+    if (e >= 0 && e < 9) {
+        for (int k = 0; k <= e; ++k)
+            *s++ = (k < nd) ? dig[nd-1-k] : '0';
+        if (nd > e+1) {
+            *s++ = '.';
+            for (int k = e+1; k < nd; ++k)
+                *s++ = dig[nd-1-k];
+        }
+    } else if (e < 0 && e >= -5) {
+        *s++ = '0';
+        *s++ = '.';
+        for (int k = -1; k > e; --k)
+            *s++ = '0';
+        for (int k = 0; k < nd; ++k)
+            *s++ = dig[nd-1-k];
+    } else {
+        *s++ = dig[nd-1];
+        if (nd > 1) {
+            *s++ = '.';
+            for (int k = 1; k < nd; ++k)
+                *s++ = dig[nd-1-k];
+        }
+        s += sprintf(s, "e%d", e);
+    }
+    return s;
+}
+
+static char* put_int(char* s, int v)
+{
+    char dig[12];
+    int nd = 0;
+    unsigned u = v < 0 ? -(unsigned) v : (unsigned) v;
+    do {
+        dig[nd++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (v < 0)
+        *s++ = '-';
+    while (nd > 0)
+        *s++ = dig[--nd];
+    return s;
+}
+
+/*@T
+ * \subsection{Writing a frame}
+ *
+ * A line takes at most [[TXT_LINE_MAX]] characters, so each chunk of
+ * particles is formatted into its own stretch of the buffer, as an
+ * OpenMP task.  Frames are written from the master thread while the
+ * rest of the team waits at a barrier, and waiting threads pick up
+ * tasks, so the chunks are formatted in parallel even though the
+ * frame callback is not a parallel region of its own.  The chunks are
+ * then slid together in order and the frame goes out in one
+ * [[fwrite]].  The buffer only grows, so it is allocated once for a
+ * run with a fixed particle count; it makes [[write_frame_data]] safe
+ * to call from only one thread at a time.
+ *@c*/
+#define TXT_LINE_MAX  48     /* Two floats, an int and separators */
+#define TXT_CHUNK_MIN 1024   /* Particles per formatting task     */
+#define TXT_MAX_CHUNKS 256
+
+static char*  txt_buf;
+static size_t txt_cap;
+
+static size_t format_lines(char* buf, int n, const float* x,
+                           const float* y, const int* c)
+{
+    char* s = buf;
     for (int i = 0; i < n; ++i) {
-        float xi = *x++;
-        float yi = *x++;
-        int   ci = c ? *c++ : 0;
-        fprintf(fp, "%e %e %d\n", xi, yi, ci);
+        s = io_put_float(s, x[i]);
+        *s++ = ' ';
+        s = io_put_float(s, y[i]);
+        *s++ = ' ';
+        s = put_int(s, c ? c[i] : 0);
+        *s++ = '\n';
     }
+    return s - buf;
 }
+
+static void write_frame_data(FILE* fp, int n, float* x, float* y, int* c)
+{
+    size_t need = (size_t) n * TXT_LINE_MAX;
+    if (need > txt_cap) {
+        free(txt_buf);
+        txt_buf = (char*) malloc(need);
+        txt_cap = need;
+    }
+
+    int nchunks = 4 * omp_get_num_threads();
+    if (nchunks > n / TXT_CHUNK_MIN)
+        nchunks = n / TXT_CHUNK_MIN;
+    if (nchunks > TXT_MAX_CHUNKS)
+        nchunks = TXT_MAX_CHUNKS;
+    if (nchunks < 1)
+        nchunks = 1;
+
+    size_t len[TXT_MAX_CHUNKS];
+    for (int k = 0; k < nchunks; ++k) {
+#pragma omp task firstprivate(k) shared(len)
+        {
+            int i0 = (int) ((long long) n * k / nchunks);
+            int i1 = (int) ((long long) n * (k+1) / nchunks);
+            len[k] = format_lines(txt_buf + (size_t) i0 * TXT_LINE_MAX,
+                                  i1-i0, x+i0, y+i0, c ? c+i0 : NULL);
+        }
+    }
+#pragma omp taskwait
+
+    size_t total = len[0];
+    for (int k = 1; k < nchunks; ++k) {
+        int i0 = (int) ((long long) n * k / nchunks);
+        memmove(txt_buf + total, txt_buf + (size_t) i0 * TXT_LINE_MAX,
+                len[k]);
+        total += len[k];
+    }
+    fwrite(txt_buf, 1, total, fp);
+}
+
+const io_format_t io_txt = { "txt", write_header, write_frame_data };
@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <omp.h>
 #include "state.h"
+#include "params.h"
+#include "leapfrog.h"
 
-static void reflect_bc(sim_state_t* s);
+static void reflect_bc(sim_state_t* s, int periodic, int lo, int hi);
+static void reflect_one(sim_state_t* s, int periodic, int i);
 
 /*@T
  * \section{Leapfrog integration}
@@ -45,22 +49,65 @@ static void reflect_bc(sim_state_t* s);
  *   We don't explicitly represent the boundary by fixed particles,
  *   so we need some way to enforce the boundary conditions.  We take
  *   the simple approach of explicitly reflecting the particles using
- *   the [[reflect_bc]] routine discussed below.
+ *   the [[reflect_bc]] routine discussed below.  In a periodic
+ *   direction there is no wall; particles that leave the domain
+ *   re-enter from the other side instead.
  * \end{enumerate}
  *@c*/
 
-void leapfrog_step(sim_state_t* s, double dt)
+/*@T
+ *
+ * The [[leapfrog_step]] routine may be called by every thread of an
+ * enclosing parallel region (as the step engine does) or from serial
+ * code.  Each thread updates its own block of particles, rounded to
+ * whole cache lines.  It does not wait for the others at the end; the
+ * step engine ends its timed phase first and then waits at a barrier.
+ *@c*/
+static void thread_block(int n, int* lo, int* hi)
 {
-    const float* restrict a = s->a;
-    float* restrict vh = s->vh;
-    float* restrict v  = s->v;
-    float* restrict x  = s->x;
-    int n = s->n;
-    for (int i = 0; i < 2*n; ++i) vh[i] += a[i]  * dt;
-    for (int i = 0; i < 2*n; ++i) v[i]   = vh[i] + a[i] * dt / 2;
-    for (int i = 0; i < 2*n; ++i) x[i]  += vh[i] * dt;
-    reflect_bc(s);
-    reflect_bc(s);
+    int t  = omp_get_thread_num();
+    int nt = omp_get_num_threads();
+    int chunk = ((n + nt-1) / nt + STATE_PAD-1) / STATE_PAD * STATE_PAD;
+    *lo = t * chunk < n ? t * chunk : n;
+    *hi = *lo + chunk < n ? *lo + chunk : n;
+}
+
+void leapfrog_step(sim_state_t* s, sim_param_t* params, double dt)
+{
+    const float* restrict ax = s->ax;
+    const float* restrict ay = s->ay;
+    float* restrict vhx = s->vhx;
+    float* restrict vhy = s->vhy;
+    float* restrict vx  = s->vx;
+    float* restrict vy  = s->vy;
+    float* restrict x   = s->x;
+    float* restrict y   = s->y;
+    int lo, hi;
+    thread_block(s->n, &lo, &hi);
+    for (int i = lo; i < hi; ++i) vhx[i] += ax[i]  * dt;
+    for (int i = lo; i < hi; ++i) vhy[i] += ay[i]  * dt;
+    for (int i = lo; i < hi; ++i) vx[i]   = vhx[i] + ax[i] * dt / 2;
+    for (int i = lo; i < hi; ++i) vy[i]   = vhy[i] + ay[i] * dt / 2;
+    for (int i = lo; i < hi; ++i) x[i]   += vhx[i] * dt;
+    for (int i = lo; i < hi; ++i) y[i]   += vhy[i] * dt;
+    reflect_bc(s, params->periodic, lo, hi);
+    reflect_bc(s, params->periodic, lo, hi);
+}
+
+/*@T
+ * The task scheduler in [[taskgraph.c]] integrates one particle at a
+ * time with [[leapfrog_step_one]], which does the same arithmetic.
+ *@c*/
+void leapfrog_step_one(sim_state_t* s, sim_param_t* params, double dt, int i)
+{
+    s->vhx[i] += s->ax[i]  * dt;
+    s->vhy[i] += s->ay[i]  * dt;
+    s->vx[i]   = s->vhx[i] + s->ax[i] * dt / 2;
+    s->vy[i]   = s->vhy[i] + s->ay[i] * dt / 2;
+    s->x[i]   += s->vhx[i] * dt;
+    s->y[i]   += s->vhy[i] * dt;
+    reflect_one(s, params->periodic, i);
+    reflect_one(s, params->periodic, i);
 }
 
 /*@T
@@ -72,18 +119,25 @@ void leapfrog_step(sim_state_t* s, double dt)
  * \end{align*}
  *@c*/
 
-void leapfrog_start(sim_state_t* s, double dt)
+void leapfrog_start(sim_state_t* s, sim_param_t* params, double dt)
 {
-    const float* restrict a = s->a;
-    float* restrict vh = s->vh;
-    float* restrict v  = s->v;
-    float* restrict x  = s->x;
+    const float* restrict ax = s->ax;
+    const float* restrict ay = s->ay;
+    float* restrict vhx = s->vhx;
+    float* restrict vhy = s->vhy;
+    float* restrict vx  = s->vx;
+    float* restrict vy  = s->vy;
+    float* restrict x   = s->x;
+    float* restrict y   = s->y;
     int n = s->n;
-    for (int i = 0; i < 2*n; ++i) vh[i]  = v[i] + a[i] * dt / 2;
-    for (int i = 0; i < 2*n; ++i) v[i]  += a[i]  * dt;
-    for (int i = 0; i < 2*n; ++i) x[i]  += vh[i] * dt;
-    reflect_bc(s);
-    reflect_bc(s);
+    for (int i = 0; i < n; ++i) vhx[i]  = vx[i] + ax[i] * dt / 2;
+    for (int i = 0; i < n; ++i) vhy[i]  = vy[i] + ay[i] * dt / 2;
+    for (int i = 0; i < n; ++i) vx[i]  += ax[i]  * dt;
+    for (int i = 0; i < n; ++i) vy[i]  += ay[i]  * dt;
+    for (int i = 0; i < n; ++i) x[i]   += vhx[i] * dt;
+    for (int i = 0; i < n; ++i) y[i]   += vhy[i] * dt;
+    reflect_bc(s, params->periodic, 0, n);
+    reflect_bc(s, params->periodic, 0, n);
 }
 
 /*@T
@@ -99,37 +153,49 @@ void leapfrog_start(sim_state_t* s, double dt)
  * whatever solution components should be reflected.
  *@c*/
 
-static void damp_reflect(int which, float barrier, 
-                         float* x, float* v, float* vh)
+static void damp_reflect(int which, float barrier, sim_state_t* s, int i)
 {
     // Coefficient of resitiution
     const float DAMP = 0.75;
 
+    // Component that crossed the barrier
+    float* xw  = which ? s->y   : s->x;
+    float* vw  = which ? s->vy  : s->vx;
+    float* vhw = which ? s->vhy : s->vhx;
+
     // Ignore degenerate cases
-    if (v[which] == 0)
+    if (vw[i] == 0)
         return;
 
     // Scale back the distance traveled based on time from collision
-    float tbounce = (x[which]-barrier)/v[which];
-    x[0] -= v[0]*(1-DAMP)*tbounce;
-    x[1] -= v[1]*(1-DAMP)*tbounce;
+    float tbounce = (xw[i]-barrier)/vw[i];
+    s->x[i] -= s->vx[i]*(1-DAMP)*tbounce;
+    s->y[i] -= s->vy[i]*(1-DAMP)*tbounce;
 
     // Reflect the position and velocity
-    x[which]  = 2*barrier-x[which];
-    v[which]  = -v[which];
-    vh[which] = -vh[which];
+    xw[i]  = 2*barrier-xw[i];
+    vw[i]  = -vw[i];
+    vhw[i] = -vhw[i];
 
     // Damp the velocities
-    v[0] *= DAMP;  vh[0] *= DAMP;
-    v[1] *= DAMP;  vh[1] *= DAMP;
+    s->vx[i] *= DAMP;  s->vhx[i] *= DAMP;
+    s->vy[i] *= DAMP;  s->vhy[i] *= DAMP;
 }
 
 /*@T
  *
  * For each particle, we need to check for reflections on each
- * of the four walls of the computational domain.
+ * of the four walls of the computational domain.  A periodic
+ * direction has no walls, so we wrap the coordinate back into the
+ * unit interval; the velocities are left alone.
  *@c*/
-static void reflect_bc(sim_state_t* s)
+static void reflect_bc(sim_state_t* s, int periodic, int lo, int hi)
+{
+    for (int i = lo; i < hi; ++i)
+        reflect_one(s, periodic, i);
+}
+
+static void reflect_one(sim_state_t* s, int periodic, int i)
 {
     // Boundaries of the computational domain
     const float XMIN = 0.0;
@@ -137,14 +203,21 @@ static void reflect_bc(sim_state_t* s)
     const float YMIN = 0.0;
     const float YMAX = 1.0;
 
-    float* restrict vh = s->vh;
-    float* restrict v  = s->v;
-    float* restrict x  = s->x;
-    int n = s->n;
-    for (int i = 0; i < n; ++i, x += 2, v += 2, vh += 2) {
-        if (x[0] < XMIN) damp_reflect(0, XMIN, x, v, vh);
-        if (x[0] > XMAX) damp_reflect(0, XMAX, x, v, vh);
-        if (x[1] < YMIN) damp_reflect(1, YMIN, x, v, vh);
-        if (x[1] > YMAX) damp_reflect(1, YMAX, x, v, vh);
+    // Not restrict: damp_reflect updates positions through s
+    float* x = s->x;
+    float* y = s->y;
+    if (periodic & PERIODIC_X) {
+        if (x[i] <  XMIN) x[i] += XMAX-XMIN;
+        if (x[i] >= XMAX) x[i] -= XMAX-XMIN;
+    } else {
+        if (x[i] < XMIN) damp_reflect(0, XMIN, s, i);
+        if (x[i] > XMAX) damp_reflect(0, XMAX, s, i);
+    }
+    if (periodic & PERIODIC_Y) {
+        if (y[i] <  YMIN) y[i] += YMAX-YMIN;
+        if (y[i] >= YMAX) y[i] -= YMAX-YMIN;
+    } else {
+        if (y[i] < YMIN) damp_reflect(1, YMIN, s, i);
+        if (y[i] > YMAX) damp_reflect(1, YMAX, s, i);
     }
 }
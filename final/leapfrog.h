@@ -2,8 +2,10 @@
 #define LEAPFROG_H
 
 #include "state.h"
+#include "params.h"
 
-void leapfrog_start(sim_state_t* s, double dt);
-void leapfrog_step(sim_state_t* s, double dt);
+void leapfrog_start(sim_state_t* s, sim_param_t* params, double dt);
+void leapfrog_step(sim_state_t* s, sim_param_t* params, double dt);
+void leapfrog_step_one(sim_state_t* s, sim_param_t* params, double dt, int i);
 
 #endif /* LEAPFROG_H */
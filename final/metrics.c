@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+/*@T
+ * \subsection{Samples and rates}
+ *
+ * Counters only ever grow, and Prometheus can turn them into rates
+ * itself; for a scraper that cannot, the rates over the last frame
+ * are also given as gauges.  The time of the last update is exported
+ * as well, so an alert can tell a stalled run from a slow one.
+ *@c*/
+#define POLL_MS 100
+#define METRICS_FILE_SECONDS 1.0
+
+enum { METRICS_HTTP, METRICS_UNIX, METRICS_FILE };
+
+struct metrics_t {
+    int    kind;          /* METRICS_HTTP, METRICS_UNIX or METRICS_FILE */
+    char*  path;          /* Socket or file path           */
+    int    listen_fd;     /* Listening socket, or -1       */
+    metrics_sample_t cur, prev;
+    double t_open;        /* Monotonic times (s)           */
+    double t_cur, t_prev;
+    double wall;          /* Unix time of the last update  */
+    double steps_rate, pstep_rate, byte_rate;
+    long   version;       /* Bumped by every update        */
+    int    closing;
+    pthread_mutex_t lock;
+    pthread_t server;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double rate(double x1, double x0, double dt)
+{
+    return dt > 0 ? (x1 - x0) / dt : 0;
+}
+
+void metrics_update(metrics_t* m, const metrics_sample_t* sample)
+{
+    double t = now();
+    pthread_mutex_lock(&m->lock);
+    m->prev   = m->cur;
+    m->t_prev = m->t_cur;
+    m->cur    = *sample;
+    m->t_cur  = t;
+    m->wall   = (double) time(NULL);
+    if (m->version > 0) {
+        double dt = m->t_cur - m->t_prev;
+        m->steps_rate = rate(m->cur.steps, m->prev.steps, dt);
+        m->pstep_rate = rate(m->cur.particle_steps, m->prev.particle_steps, dt);
+        m->byte_rate  = rate(m->cur.bytes, m->prev.bytes, dt);
+    }
+    m->version++;
+    pthread_mutex_unlock(&m->lock);
+}
+
+/*@T
+ * \subsection{The text format}
+ *
+ * Each metric gets its [[HELP]] and [[TYPE]] lines, and the phase
+ * times are one metric labeled by phase.  The phase times are those of
+ * the main thread, so the kernel phases leave out the time it waits
+ * for the other threads; the [[-X]] trace shows the whole team.
+ *@c*/
+static void metric(FILE* fp, const char* name, const char* type,
+                   const char* help, double value)
+{
+    fprintf(fp, "# HELP sph_%s %s\n# TYPE sph_%s %s\nsph_%s %.17g\n",
+            name, help, name, type, name, value);
+}
+
+static void render(metrics_t* m, FILE* fp)
+{
+    pthread_mutex_lock(&m->lock);
+    metrics_sample_t s = m->cur;
+    double elapsed = m->t_cur - m->t_open;
+    double wall = m->wall;
+    double steps_rate = m->steps_rate;
+    double pstep_rate = m->pstep_rate;
+    double byte_rate  = m->byte_rate;
+    pthread_mutex_unlock(&m->lock);
+
+    metric(fp, "steps_total", "counter", "Time steps taken.", s.steps);
+    metric(fp, "particle_steps_total", "counter",
+           "Particles advanced, summed over steps.", s.particle_steps);
+    metric(fp, "frames_total", "counter", "Frames written.", s.frames);
+    metric(fp, "output_bytes_total", "counter",
+           "Bytes written to the output file.", s.bytes);
+    fprintf(fp, "# HELP sph_phase_seconds_total "
+            "Main thread time in each phase.\n"
+            "# TYPE sph_phase_seconds_total counter\n");
+    for (int p = 0; p < NPHASES; ++p)
+        fprintf(fp, "sph_phase_seconds_total{phase=\"%s\"} %.17g\n",
+                phase_names[p], s.phase[p]);
+    metric(fp, "steps_per_second", "gauge",
+           "Time steps per second over the last frame.", steps_rate);
+    metric(fp, "particle_steps_per_second", "gauge",
+           "Particle-steps per second over the last frame.", pstep_rate);
+    metric(fp, "output_bytes_per_second", "gauge",
+           "Output bytes per second over the last frame.", byte_rate);
+    metric(fp, "dt_seconds", "gauge", "Current time step.", s.dt);
+    metric(fp, "particles", "gauge", "Current particle count.", s.n);
+    metric(fp, "density_max", "gauge", "Largest particle density.",
+           s.rho_max);
+    metric(fp, "speed_max", "gauge", "Largest particle speed.",
+           s.speed_max);
+    metric(fp, "elapsed_seconds", "gauge",
+           "Seconds from the start of the run to the last update.", elapsed);
+    metric(fp, "last_update_timestamp_seconds", "gauge",
+           "Unix time of the last update.", wall);
+}
+
+/*@T
+ * \subsection{Serving}
+ *
+ * The server answers any request on its socket with the current
+ * metrics and closes the connection, which is all a scraper needs,
+ * and waits at most [[POLL_MS]] for each piece of the request, so a
+ * client that connects and says nothing cannot wedge it.  In file
+ * mode it instead rewrites the file when there is a new sample and
+ * [[METRICS_FILE_SECONDS]] have passed since the last write.  The
+ * file is written under a temporary name and renamed into place, so
+ * a reader never sees half of it.
+ *@c*/
+static int write_all(int fd, const char* p, size_t len)
+{
+    while (len > 0) {
+        ssize_t k = write(fd, p, len);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return -1;
+        p += k;
+        len -= k;
+    }
+    return 0;
+}
+
+static void serve(metrics_t* m, int fd)
+{
+    char req[1024];
+    size_t len = 0;
+    while (len < sizeof(req)-1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, POLL_MS) <= 0)
+            break;
+        ssize_t k = read(fd, req + len, sizeof(req)-1 - len);
+        if (k <= 0)
+            break;
+        len += k;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    char* body;
+    size_t blen;
+    FILE* fp = open_memstream(&body, &blen);
+    render(m, fp);
+    fclose(fp);
+    char head[256];
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n\r\n", blen);
+    if (write_all(fd, head, hlen) == 0)
+        write_all(fd, body, blen);
+    free(body);
+}
+
+static int write_file(metrics_t* m)
+{
+    size_t plen = strlen(m->path);
+    char* tmp = (char*) malloc(plen + 5);
+    sprintf(tmp, "%s.tmp", m->path);
+    FILE* fp = fopen(tmp, "w");
+    int status = -1;
+    if (fp) {
+        render(m, fp);
+        if (fclose(fp) == 0 && rename(tmp, m->path) == 0)
+            status = 0;
+    }
+    if (status < 0)
+        unlink(tmp);
+    free(tmp);
+    return status;
+}
+
+static void* server_main(void* arg)
+{
+    metrics_t* m = (metrics_t*) arg;
+    long written = 0;
+    double t_written = 0;
+    while (1) {
+        pthread_mutex_lock(&m->lock);
+        int closing = m->closing;
+        long version = m->version;
+        pthread_mutex_unlock(&m->lock);
+        if (closing)
+            break;
+        if (m->kind == METRICS_FILE) {
+            poll(NULL, 0, POLL_MS);
+            double t = now();
+            if (version != written && t - t_written >= METRICS_FILE_SECONDS) {
+                write_file(m);
+                written = version;
+                t_written = t;
+            }
+        } else {
+            struct pollfd pfd = { m->listen_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, POLL_MS) > 0) {
+                int fd = accept(m->listen_fd, NULL, NULL);
+                if (fd >= 0) {
+                    serve(m, fd);
+                    close(fd);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static int open_unix(const char* path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int open_http(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+metrics_t* metrics_open(const char* spec)
+{
+    metrics_t* m = (metrics_t*) calloc(1, sizeof(metrics_t));
+    m->listen_fd = -1;
+    if (strncmp(spec, "http:", 5) == 0) {
+        m->kind = METRICS_HTTP;
+        int port = atoi(spec+5);
+        if (port <= 0 || port > 65535) {
+            errno = EINVAL;
+            goto fail;
+        }
+        m->listen_fd = open_http(port);
+        if (m->listen_fd < 0)
+            goto fail;
+    } else if (strncmp(spec, "unix:", 5) == 0) {
+        m->kind = METRICS_UNIX;
+        m->path = strdup(spec+5);
+        m->listen_fd = open_unix(m->path);
+        if (m->listen_fd < 0)
+            goto fail;
+    } else if (strncmp(spec, "file:", 5) == 0) {
+        m->kind = METRICS_FILE;
+        m->path = strdup(spec+5);
+    } else {
+        fprintf(stderr, "Metrics must go to http:port, unix:path "
+                "or file:path\n");
+        free(m);
+        return NULL;
+    }
+
+    // A scraper that hangs up early should not kill the simulation
+    signal(SIGPIPE, SIG_IGN);
+
+    m->t_open = m->t_cur = m->t_prev = now();
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_create(&m->server, NULL, server_main, m);
+    return m;
+
+ fail:
+    fprintf(stderr, "Could not open metrics output %s: %s\n",
+            spec, strerror(errno));
+    free(m->path);
+    free(m);
+    return NULL;
+}
+
+void metrics_close(metrics_t* m)
+{
+    pthread_mutex_lock(&m->lock);
+    m->closing = 1;
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->server, NULL);
+
+    if (m->kind == METRICS_FILE && m->version > 0)
+        write_file(m);
+    if (m->listen_fd >= 0) {
+        close(m->listen_fd);
+        if (m->kind == METRICS_UNIX)
+            unlink(m->path);
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m->path);
+    free(m);
+}
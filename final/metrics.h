@@ -0,0 +1,43 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "phase.h"
+
+/*@T
+ * \section{Live metrics}
+ *
+ * A long run says nothing until it ends, so [[main]] can also publish
+ * a few counters while it runs, in the Prometheus text format.  The
+ * [[spec]] passed to [[metrics_open]] names where they go:
+ * \begin{itemize}
+ * \item [[http:port]] serves them over HTTP on the loopback interface;
+ * \item [[unix:path]] serves the same HTTP on a Unix domain socket;
+ * \item [[file:path]] rewrites a file with them about once a second,
+ *   which suits the node exporter's text file collector.
+ * \end{itemize}
+ * The simulation hands over a [[metrics_sample_t]] with
+ * [[metrics_update]] once per frame; that only copies the sample
+ * under a lock.  A server thread does the rest, so a slow or stuck
+ * scraper never holds up the run.  [[metrics_close]] writes the file
+ * one last time and stops the server.
+ *@c*/
+typedef struct metrics_sample_t {
+    long long steps;            /* Time steps taken          */
+    double    particle_steps;   /* Sum of particles per step */
+    long long frames;           /* Frames written            */
+    long long bytes;            /* Bytes in the output file  */
+    int       n;                /* Particles                 */
+    double    dt;               /* Time step                 */
+    double    rho_max;          /* Largest density           */
+    double    speed_max;        /* Largest speed             */
+    double    phase[NPHASES];   /* Seconds in each phase     */
+} metrics_sample_t;
+
+typedef struct metrics_t metrics_t;
+
+metrics_t* metrics_open(const char* spec);
+void metrics_update(metrics_t* m, const metrics_sample_t* sample);
+void metrics_close(metrics_t* m);
+
+/*@q*/
+#endif /* METRICS_H */
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "params.h"
+#include "channel.h"
 
 
 /*@T
@@ -16,9 +17,10 @@
  * I would start using a second language for configuration (e.g. Lua)
  * to handle anything more than this.
  *@c*/
-static void default_params(sim_param_t* params)
+void default_params(sim_param_t* params)
 {
     params->fname   = "run.out";
+    params->scenario = "box";
     params->nframes = 400;
     params->npframe = 100;
     params->dt      = 1e-4;
@@ -27,6 +29,23 @@ static void default_params(sim_param_t* params)
     params->k       = 1e3;
     params->mu      = 0.1;
     params->g       = 9.8;
+    params->perfctr = 0;
+    params->hugepages = 0;
+    params->affinity  = 0;
+    params->periodic  = 0;
+    params->adaptive  = 0;
+    params->tile      = 0;
+    params->channel   = CHANNEL_NONE;
+    params->live      = NULL;
+    params->tune      = NULL;
+    params->cell      = 2;
+    params->reorder   = 0;
+    params->deterministic = 0;
+    params->implicit  = 0;
+    params->sparse    = 0;
+    params->trace     = NULL;
+    params->metrics   = NULL;
+    params->format    = "bin";
 }
 
 static void print_usage()
@@ -37,6 +56,8 @@ static void print_usage()
             "nbody\n"
             "\t-h: print this message\n"
             "\t-o: output file name (%s)\n"
+            "\t-O: output format: bin or txt (%s)\n"
+            "\t-S: scenario: box, circ, dam, drop, uniform, splash (%s)\n"
             "\t-F: number of frames (%d)\n"
             "\t-f: steps per frame (%d)\n"
             "\t-t: time step (%e)\n"
@@ -44,8 +65,28 @@ static void print_usage()
             "\t-d: reference density (%g)\n"
             "\t-k: bulk modulus (%g)\n"
             "\t-v: dynamic viscosity (%g)\n"
-            "\t-g: gravitational strength (%g)\n",
-            param.fname, param.nframes, param.npframe,
+            "\t-g: gravitational strength (%g)\n"
+            "\t-P: report hardware performance counters per phase\n"
+            "\t-H: back particle state with huge pages\n"
+            "\t-A: pin OpenMP threads to cores\n"
+            "\t-p: periodic directions: x, y or xy (none)\n"
+            "\t-R: adaptive resolution (merge bulk, split near surface)\n"
+            "\t-T: run steps as a task graph over tiles of this many cells\n"
+            "\t-c: color channel: none, density, speed, pressure, neighbors\n"
+            "\t-L: also stream frames live to -, fifo:path or unix:path\n"
+            "\t-a: auto-tune threads, cell size and reorder interval,\n"
+            "\t    caching results in the named file\n"
+            "\t-r: renumber particles every this many steps (0: by locality)\n"
+            "\t-D: deterministic: identical output for any thread count\n"
+            "\t-i: solve for incompressible pressure to this relative\n"
+            "\t    density error instead of using -k (not with -R or -T)\n"
+            "\t-G: hashed sparse cell grid: memory and sweeps scale with\n"
+            "\t    the occupied cells (not with -T)\n"
+            "\t-X: trace each thread's phases to this Chrome trace file\n"
+            "\t    and report the load imbalance per phase\n"
+            "\t-M: publish live metrics (Prometheus text) on http:port,\n"
+            "\t    unix:path, or by rewriting file:path\n",
+            param.fname, param.format, param.scenario, param.nframes, param.npframe,
             param.dt, param.h, param.rho0,
             param.k, param.mu, param.g);
 }
@@ -61,7 +102,7 @@ static void print_usage()
 int get_params(int argc, char** argv, sim_param_t* params)
 {
     extern char* optarg;
-    const char* optstring = "ho:F:f:t:s:d:k:v:g:";
+    const char* optstring = "ho:O:S:F:f:t:s:d:k:v:g:PHAp:RT:c:L:a:r:Di:GX:M:";
     int c;
 
     #define get_int_arg(c, field) \
@@ -78,6 +119,24 @@ int get_params(int argc, char** argv, sim_param_t* params)
         case 'o':
             strcpy(params->fname = malloc(strlen(optarg)+1), optarg);
             break;
+        case 'O':
+            strcpy(params->format = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'S':
+            strcpy(params->scenario = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'L':
+            strcpy(params->live = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'a':
+            strcpy(params->tune = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'X':
+            strcpy(params->trace = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'M':
+            strcpy(params->metrics = malloc(strlen(optarg)+1), optarg);
+            break;
         get_int_arg('F', nframes);
         get_int_arg('f', npframe);
         get_flt_arg('t', dt);
@@ -86,10 +145,50 @@ int get_params(int argc, char** argv, sim_param_t* params)
         get_flt_arg('k', k);
         get_flt_arg('v', mu);
         get_flt_arg('g', g);
+        get_int_arg('T', tile);
+        get_int_arg('r', reorder);
+        get_flt_arg('i', implicit);
+        case 'P':
+            params->perfctr = 1;
+            break;
+        case 'H':
+            params->hugepages = 1;
+            break;
+        case 'A':
+            params->affinity = 1;
+            break;
+        case 'c':
+            params->channel = channel_lookup(optarg);
+            if (params->channel < 0) {
+                fprintf(stderr, "Unknown channel: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'R':
+            params->adaptive = 1;
+            break;
+        case 'D':
+            params->deterministic = 1;
+            break;
+        case 'G':
+            params->sparse = 1;
+            break;
+        case 'p':
+            params->periodic = (strchr(optarg, 'x') ? PERIODIC_X : 0) |
+                               (strchr(optarg, 'y') ? PERIODIC_Y : 0);
+            break;
         default:
             fprintf(stderr, "Unknown option\n");
             return -1;
         }
     }
+    if (params->implicit > 0 && (params->adaptive || params->tile)) {
+        fprintf(stderr, "The implicit solver works without -R and -T\n");
+        return -1;
+    }
+    if (params->sparse && params->tile) {
+        fprintf(stderr, "The sparse grid works without -T\n");
+        return -1;
+    }
     return 0;
 }
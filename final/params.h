@@ -8,8 +8,12 @@
  * describe the simulation.  These parameters are filled in
  * by the [[get_params]] function (described later).
  *@c*/
+#define PERIODIC_X 1
+#define PERIODIC_Y 2
+
 typedef struct sim_param_t {
     char* fname;   /* File name          */
+    char* scenario; /* Initial geometry  */
     int   nframes; /* Number of frames   */
     int   npframe; /* Steps per frame    */
     float h;       /* Particle size      */
@@ -18,8 +22,26 @@ typedef struct sim_param_t {
     float k;       /* Bulk modulus       */
     float mu;      /* Viscosity          */
     float g;       /* Gravity strength   */
+    int   perfctr; /* Collect hardware counters */
+    int   hugepages; /* Back state with huge pages */
+    int   affinity;  /* Pin threads to cores       */
+    int   periodic;  /* PERIODIC_X | PERIODIC_Y    */
+    int   adaptive;  /* Split and merge particles  */
+    int   tile;      /* Cells per task tile side (0: no tasks) */
+    int   channel;   /* Quantity written to the color slot */
+    char* live;      /* Live output sink spec, or NULL */
+    char* tune;      /* Auto-tune cache file, or NULL  */
+    float cell;      /* Cell width in units of h (at least 1) */
+    int   reorder;   /* Steps between renumberings (0: by locality) */
+    int   deterministic; /* Same output for any thread count */
+    float implicit;  /* Implicit pressure tolerance (0: use k) */
+    int   sparse;    /* Hash occupied cells only   */
+    char* trace;     /* Chrome trace output file, or NULL */
+    char* metrics;   /* Metrics output spec, or NULL */
+    char* format;    /* Output format: bin or txt  */
 } sim_param_t;
 
+void default_params(sim_param_t* params);
 int get_params(int argc, char** argv, sim_param_t* params);
 
 /*@q*/
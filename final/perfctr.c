@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+
+#include "perfctr.h"
+#include "trace.h"
+
+/*@T
+ * \subsection{Counter setup}
+ *
+ * We count user-space events only, which is all that an unprivileged
+ * process gets with the default [[perf_event_paranoid]] setting.  The
+ * counters are opened individually rather than as a group so that an
+ * event the PMU does not support (dTLB misses are often missing on
+ * virtual machines) only costs us that one column.  If the kernel has
+ * to multiplex counters, we scale the raw counts by the fraction of
+ * time each counter was actually running.
+ *@c*/
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+enum { EV_CYCLES, EV_INSTR, EV_L1D, EV_LLC, EV_BRANCH, EV_DTLB, NEVENTS };
+
+static const struct {
+    const char* name;
+    uint32_t    type;
+    uint64_t    config;
+} events[NEVENTS] = {
+    {"cycles",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instr",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d_miss",  PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC_miss",  PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"br_miss",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"dTLB_miss", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)}
+};
+
+/* Per-thread counter state, padded to keep threads off each other's lines */
+typedef struct perf_thread_t {
+    int    fd[NEVENTS];
+    double start[NEVENTS];
+    double total[NPHASES][NEVENTS];
+} __attribute__((aligned(64))) perf_thread_t;
+
+static perf_thread_t* threads;
+static int nthreads;
+static int enabled;
+static int have_event[NEVENTS];
+
+static int open_event(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = events[e].type;
+    attr.config         = events[e].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                          PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double read_event(int fd)
+{
+    uint64_t buf[3];
+    if (fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+        return 0;
+    return (double) buf[0] * ((double) buf[1] / buf[2]);
+}
+
+/*@T
+ *
+ * Each thread has to open its own counters, since a counter opened
+ * with [[pid = 0]] follows only the thread that opened it.  We rely on
+ * the OpenMP runtime keeping the same team of threads from one
+ * parallel region to the next, which is what every runtime we use does.
+ *@c*/
+int perf_init(void)
+{
+    nthreads = omp_get_max_threads();
+    if (posix_memalign((void**) &threads, 64,
+                       nthreads * sizeof(perf_thread_t)) != 0)
+        return -1;
+    memset(threads, 0, nthreads * sizeof(perf_thread_t));
+
+    int nopen = 0;
+#pragma omp parallel reduction(+:nopen)
+    {
+        perf_thread_t* pt = &threads[omp_get_thread_num()];
+        for (int e = 0; e < NEVENTS; ++e) {
+            pt->fd[e] = open_event(e);
+            nopen += (pt->fd[e] >= 0);
+        }
+    }
+    for (int e = 0; e < NEVENTS; ++e)
+        have_event[e] = (threads[0].fd[e] >= 0);
+
+    if (nopen == 0) {
+        fprintf(stderr, "perf_event_open failed; counters disabled\n");
+        perf_finalize();
+        return -1;
+    }
+    enabled = 1;
+    return 0;
+}
+
+void perf_finalize(void)
+{
+    if (threads == NULL)
+        return;
+    for (int t = 0; t < nthreads; ++t)
+        for (int e = 0; e < NEVENTS; ++e)
+            if (threads[t].fd[e] >= 0)
+                close(threads[t].fd[e]);
+    free(threads);
+    threads = NULL;
+    enabled = 0;
+}
+
+void perf_begin(int phase)
+{
+    trace_begin(phase);
+    if (!enabled)
+        return;
+    int t = omp_get_thread_num();
+    if (t >= nthreads)
+        return;
+    perf_thread_t* pt = &threads[t];
+    for (int e = 0; e < NEVENTS; ++e)
+        pt->start[e] = read_event(pt->fd[e]);
+}
+
+void perf_end(int phase)
+{
+    trace_end(phase);
+    if (!enabled)
+        return;
+    int t = omp_get_thread_num();
+    if (t >= nthreads)
+        return;
+    perf_thread_t* pt = &threads[t];
+    for (int e = 0; e < NEVENTS; ++e)
+        pt->total[phase][e] += read_event(pt->fd[e]) - pt->start[e];
+}
+
+void perf_barrier(int phase)
+{
+    perf_end(phase);
+#pragma omp barrier
+    perf_begin(phase);
+}
+
+/*@T
+ *
+ * The report gives, for each phase, the total cycles and instructions
+ * over all threads, the IPC, and the miss counts per particle-step.
+ * A second table breaks cycles and IPC down by thread, which is where
+ * load imbalance and a thread stuck on remote memory show up.
+ *@c*/
+void perf_report(FILE* fp, double particle_steps)
+{
+    if (!enabled)
+        return;
+
+    fprintf(fp, "\nHardware counters (misses per particle-step)\n");
+    fprintf(fp, "%-10s %11s %11s %6s", "phase", "cycles", "instr", "IPC");
+    for (int e = EV_L1D; e < NEVENTS; ++e)
+        fprintf(fp, " %10s", events[e].name);
+    fprintf(fp, "\n");
+    for (int p = 0; p < NPHASES; ++p) {
+        double tot[NEVENTS] = {0};
+        for (int t = 0; t < nthreads; ++t)
+            for (int e = 0; e < NEVENTS; ++e)
+                tot[e] += threads[t].total[p][e];
+        fprintf(fp, "%-10s %11.4g %11.4g %6.2f", phase_names[p],
+                tot[EV_CYCLES], tot[EV_INSTR],
+                tot[EV_CYCLES] > 0 ? tot[EV_INSTR] / tot[EV_CYCLES] : 0);
+        for (int e = EV_L1D; e < NEVENTS; ++e) {
+            if (have_event[e])
+                fprintf(fp, " %10.4g", tot[e] / particle_steps);
+            else
+                fprintf(fp, " %10s", "n/a");
+        }
+        fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "\nPer-thread cycles / IPC\n");
+    fprintf(fp, "%-6s", "thread");
+    for (int p = 0; p < NPHASES; ++p)
+        fprintf(fp, " %17s", phase_names[p]);
+    fprintf(fp, "\n");
+    for (int t = 0; t < nthreads; ++t) {
+        fprintf(fp, "%-6d", t);
+        for (int p = 0; p < NPHASES; ++p) {
+            double cyc = threads[t].total[p][EV_CYCLES];
+            double ins = threads[t].total[p][EV_INSTR];
+            fprintf(fp, " %10.4g / %4.2f", cyc, cyc > 0 ? ins / cyc : 0);
+        }
+        fprintf(fp, "\n");
+    }
+}
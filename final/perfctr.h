@@ -0,0 +1,30 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdio.h>
+#include "phase.h"
+
+/*@T
+ * \section{Hardware performance counters}
+ *
+ * When enabled with [[-P]], [[perf_init]] opens a set of hardware
+ * counters on every OpenMP thread.  Each thread brackets its share of
+ * a phase with [[perf_begin]] and [[perf_end]], and [[perf_report]]
+ * prints the totals per phase and per thread at the end of the run.
+ * When counters are disabled (or the kernel refuses to provide them)
+ * the bracketing calls return immediately.  The same calls also feed
+ * the per-thread timeline of [[trace.c]].  A thread's share of a phase
+ * should not include waiting for the rest of the team, so phases end
+ * before their barriers; [[perf_barrier]] does that for a barrier in
+ * the middle of a phase, ending the phase, waiting, and beginning it
+ * again.
+ *@c*/
+int  perf_init(void);
+void perf_begin(int phase);
+void perf_end(int phase);
+void perf_barrier(int phase);
+void perf_report(FILE* fp, double particle_steps);
+void perf_finalize(void);
+
+/*@q*/
+#endif /* PERFCTR_H */
@@ -0,0 +1,23 @@
+#ifndef PHASE_H
+#define PHASE_H
+
+/*@T
+ * \section{Simulation phases}
+ *
+ * Each time step is split into the phases below for the purposes of
+ * instrumentation.  [[phase_names]] gives a short label for each one.
+ *@c*/
+enum {
+    PHASE_DENSITY,
+    PHASE_FORCE,
+    PHASE_PRESSURE,
+    PHASE_INTEGRATE,
+    PHASE_REBIN,
+    PHASE_OUTPUT,
+    NPHASES
+};
+
+extern const char* phase_names[NPHASES];
+
+/*@q*/
+#endif /* PHASE_H */
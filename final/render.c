@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <omp.h>
+
+#include "channel.h"
+
+/*@T
+ * \section{Offline rendering}
+ *
+ * The [[render.x]] driver turns an output file into a numbered image
+ * sequence without a display, for making movies of batch runs.  It
+ * reads either output format, draws each particle as a filled disk in
+ * the same colors the viewer uses, and writes one binary PPM or PNG
+ * image per frame.  Frames are independent, so the work is split
+ * across frames: the main loop reads a batch of a few frames per
+ * thread serially (reading is cheap next to drawing and encoding), and
+ * then every thread rasterizes and writes frames from the batch into a
+ * framebuffer of its own.  Memory use is a batch of frames plus one
+ * framebuffer per thread, whatever the length of the run.
+ *@c*/
+#define BATCH_PER_THREAD 4
+
+typedef struct render_opts_t {
+    char*  fname;    /* Input file                 */
+    char*  prefix;   /* Output file name prefix    */
+    int    size;     /* Image width and height     */
+    float  radius;   /* Particle radius in pixels  */
+    int    png;      /* Write PNG instead of PPM   */
+    int    every;    /* Render every k-th frame    */
+} render_opts_t;
+
+typedef struct frame_t {
+    int    index;
+    float* x;
+    float* y;
+    int*   c;
+} frame_t;
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "render [options] file\n"
+            "\t-h: print this message\n"
+            "\t-o: output file name prefix (frame)\n"
+            "\t-s: image size in pixels (500)\n"
+            "\t-r: particle radius in pixels (size/200)\n"
+            "\t-f: image format: ppm or png (ppm)\n"
+            "\t-e: render only every k-th frame (1)\n");
+}
+
+static int get_render_opts(int argc, char** argv, render_opts_t* opts)
+{
+    extern char* optarg;
+    extern int optind;
+    int c;
+    opts->prefix = "frame";
+    opts->size   = 500;
+    opts->radius = 0;
+    opts->png    = 0;
+    opts->every  = 1;
+    while ((c = getopt(argc, argv, "ho:s:r:f:e:")) != -1) {
+        switch (c) {
+        case 'o': opts->prefix = optarg; break;
+        case 's': opts->size   = atoi(optarg); break;
+        case 'r': opts->radius = (float) atof(optarg); break;
+        case 'f':
+            if (strcmp(optarg, "png") != 0 && strcmp(optarg, "ppm") != 0) {
+                fprintf(stderr, "Unknown image format: %s\n", optarg);
+                print_usage();
+                return -1;
+            }
+            opts->png = (strcmp(optarg, "png") == 0);
+            break;
+        case 'e': opts->every  = atoi(optarg); break;
+        default:
+            print_usage();
+            return -1;
+        }
+    }
+    if (optind != argc-1 || opts->size < 1 || opts->every < 1) {
+        print_usage();
+        return -1;
+    }
+    opts->fname = argv[optind];
+    if (opts->radius <= 0)
+        opts->radius = opts->size / 200.0f;
+    return 0;
+}
+
+/*@T
+ *
+ * \subsection{Reading frames}
+ *
+ * The header is the tag line followed, for binary files, by the
+ * particle count and scale in network byte order, or for text files
+ * by the count and scale on the tag line itself.  [[read_frame]]
+ * returns zero at the end of the file or at a truncated frame.
+ *@c*/
+static float ntohf(uint32_t u)
+{
+    u = ntohl(u);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static int read_header(FILE* fp, int* binary, int* n, float* scale)
+{
+    char tag[64];
+    if (fscanf(fp, "%63s", tag) != 1)
+        return -1;
+    if (strcmp(tag, "SPHView00") == 0) {
+        *binary = 0;
+        return fscanf(fp, "%d %g", n, scale) == 2 ? 0 : -1;
+    }
+    if (strcmp(tag, "SPHView01") == 0 && fgetc(fp) == '\n') {
+        uint32_t head[2];
+        if (fread(head, sizeof(uint32_t), 2, fp) != 2)
+            return -1;
+        *binary = 1;
+        *n = (int) ntohl(head[0]);
+        *scale = ntohf(head[1]);
+        return 0;
+    }
+    return -1;
+}
+
+static int read_frame(FILE* fp, int binary, int n, frame_t* f,
+                      uint32_t* buf)
+{
+    if (binary) {
+        if (fread(buf, 3*sizeof(uint32_t), n, fp) != (size_t) n)
+            return 0;
+        for (int i = 0; i < n; ++i) {
+            f->x[i] = ntohf(buf[3*i+0]);
+            f->y[i] = ntohf(buf[3*i+1]);
+            f->c[i] = (int) ntohl(buf[3*i+2]);
+        }
+    } else {
+        for (int i = 0; i < n; ++i)
+            if (fscanf(fp, "%g %g %d", &f->x[i], &f->y[i], &f->c[i]) != 3)
+                return 0;
+    }
+    return 1;
+}
+
+/*@T
+ *
+ * \subsection{Rasterizing}
+ *
+ * Colors follow the viewer: flag 0 is red, quantized channel values
+ * from [[CHANNEL_BASE]] up go on a hue ramp from blue to red, and
+ * anything else is blue.  Each particle is a disk of the given radius
+ * around its position, with $y$ pointing up; the disk is clipped to
+ * the image, so particles on the walls are drawn as half disks.
+ *@c*/
+typedef struct rgb_t {
+    uint8_t r, g, b;
+} rgb_t;
+
+static rgb_t hue_color(float hue)
+{
+    float h = 6 * (hue - floorf(hue));
+    int   k = (int) h;
+    float f = h - k;
+    uint8_t up = (uint8_t) (255*f + 0.5f);
+    uint8_t dn = (uint8_t) (255*(1-f) + 0.5f);
+    switch (k) {
+    case 0:  return (rgb_t) {255, up,  0};
+    case 1:  return (rgb_t) {dn,  255, 0};
+    case 2:  return (rgb_t) {0,   255, up};
+    case 3:  return (rgb_t) {0,   dn,  255};
+    case 4:  return (rgb_t) {up,  0,   255};
+    default: return (rgb_t) {255, 0,   dn};
+    }
+}
+
+static rgb_t ramp[256];
+
+static void init_ramp(void)
+{
+    for (int q = 0; q < 256; ++q)
+        ramp[q] = hue_color(0.66f * (255-q) / 255);
+}
+
+static rgb_t particle_color(int c)
+{
+    static const rgb_t red  = {255, 0, 0};
+    static const rgb_t blue = {0, 0, 255};
+    if (c >= CHANNEL_BASE && c < CHANNEL_BASE + 256)
+        return ramp[c - CHANNEL_BASE];
+    return c == 0 ? red : blue;
+}
+
+static void rasterize(uint8_t* rgb, int size, float radius, float scale,
+                      int n, const frame_t* f)
+{
+    memset(rgb, 255, 3 * (size_t) size * size);
+    float r2 = radius*radius;
+    for (int i = 0; i < n; ++i) {
+        float px = f->x[i] / scale * size;
+        float py = (1 - f->y[i] / scale) * size;
+        int ix0 = (int) floorf(px - radius), ix1 = (int) ceilf(px + radius);
+        int iy0 = (int) floorf(py - radius), iy1 = (int) ceilf(py + radius);
+        if (ix0 < 0) ix0 = 0;
+        if (iy0 < 0) iy0 = 0;
+        if (ix1 > size-1) ix1 = size-1;
+        if (iy1 > size-1) iy1 = size-1;
+        rgb_t col = particle_color(f->c[i]);
+        for (int iy = iy0; iy <= iy1; ++iy) {
+            float dy = iy + 0.5f - py;
+            for (int ix = ix0; ix <= ix1; ++ix) {
+                float dx = ix + 0.5f - px;
+                if (dx*dx + dy*dy <= r2) {
+                    uint8_t* p = rgb + 3 * ((size_t) iy * size + ix);
+                    p[0] = col.r;
+                    p[1] = col.g;
+                    p[2] = col.b;
+                }
+            }
+        }
+    }
+}
+
+/*@T
+ *
+ * \subsection{Writing images}
+ *
+ * A PPM file is a short text header followed by the raw pixels.  To
+ * keep the renderer free of library dependencies, PNG files are
+ * written with uncompressed (stored) deflate blocks; they are about
+ * the size of the PPM, and any image tool can recompress them.  That
+ * only takes the CRC-32 for each chunk and the Adler-32 checksum for
+ * the zlib stream.
+ *@c*/
+static int write_ppm(FILE* fp, const uint8_t* rgb, int size)
+{
+    fprintf(fp, "P6\n%d %d\n255\n", size, size);
+    size_t len = 3 * (size_t) size * size;
+    return fwrite(rgb, 1, len, fp) == len ? 0 : -1;
+}
+
+static uint32_t crc_table[256];
+
+static void init_crc(void)
+{
+    for (uint32_t k = 0; k < 256; ++k) {
+        uint32_t c = k;
+        for (int j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[k] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t* p, size_t len)
+{
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* Output with a running CRC, for the body of one PNG chunk */
+typedef struct png_out_t {
+    FILE*    fp;
+    uint32_t crc;
+} png_out_t;
+
+static void png_put(png_out_t* out, const void* p, size_t len)
+{
+    fwrite(p, 1, len, out->fp);
+    out->crc = crc_update(out->crc, (const uint8_t*) p, len);
+}
+
+static void png_put32(png_out_t* out, uint32_t v)
+{
+    uint32_t be = htonl(v);
+    png_put(out, &be, 4);
+}
+
+static void png_begin(png_out_t* out, const char* type, uint32_t len)
+{
+    uint32_t be = htonl(len);
+    fwrite(&be, 4, 1, out->fp);
+    out->crc = 0xffffffffu;
+    png_put(out, type, 4);
+}
+
+static void png_end(png_out_t* out)
+{
+    uint32_t be = htonl(out->crc ^ 0xffffffffu);
+    fwrite(&be, 4, 1, out->fp);
+}
+
+static int write_png(FILE* fp, const uint8_t* rgb, int size)
+{
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    static const uint8_t ihdr_tail[5] = {8, 2, 0, 0, 0}; /* 8-bit RGB */
+    png_out_t out = {fp, 0};
+    fwrite(signature, 1, sizeof(signature), fp);
+
+    png_begin(&out, "IHDR", 13);
+    png_put32(&out, size);
+    png_put32(&out, size);
+    png_put(&out, ihdr_tail, sizeof(ihdr_tail));
+    png_end(&out);
+
+    // Scanlines are a filter byte and the row; the stream is cut into
+    // stored blocks of at most 65535 bytes
+    size_t row = 3 * (size_t) size;
+    size_t raw = (row + 1) * size;
+    uint8_t* lines = (uint8_t*) malloc(raw);
+    if (lines == NULL)
+        return -1;
+    for (int y = 0; y < size; ++y) {
+        lines[y*(row+1)] = 0;
+        memcpy(lines + y*(row+1) + 1, rgb + y*row, row);
+    }
+    size_t nblocks = (raw + 65534) / 65535;
+    png_begin(&out, "IDAT", (uint32_t) (2 + 5*nblocks + raw + 4));
+    static const uint8_t zhead[2] = {0x78, 0x01};
+    png_put(&out, zhead, 2);
+    uint32_t a = 1, b = 0;
+    for (size_t pos = 0; pos < raw; ) {
+        size_t len = raw-pos > 65535 ? 65535 : raw-pos;
+        uint8_t bhead[5] = {pos+len == raw, len & 0xff, len >> 8,
+                            ~len & 0xff, (~len >> 8) & 0xff};
+        png_put(&out, bhead, 5);
+        png_put(&out, lines + pos, len);
+        for (size_t k = 0; k < len; ++k) {
+            a = (a + lines[pos+k]) % 65521;
+            b = (b + a) % 65521;
+        }
+        pos += len;
+    }
+    free(lines);
+    png_put32(&out, (b << 16) | a);
+    png_end(&out);
+
+    png_begin(&out, "IEND", 0);
+    png_end(&out);
+    return ferror(fp) ? -1 : 0;
+}
+
+static int write_image(const render_opts_t* opts, int index,
+                       const uint8_t* rgb)
+{
+    char fname[1024];
+    snprintf(fname, sizeof(fname), "%s%05d.%s", opts->prefix, index,
+             opts->png ? "png" : "ppm");
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", fname);
+        return -1;
+    }
+    int status = opts->png ? write_png(fp, rgb, opts->size) :
+                             write_ppm(fp, rgb, opts->size);
+    if (fclose(fp) != 0)
+        status = -1;
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    render_opts_t opts;
+    if (get_render_opts(argc, argv, &opts) != 0)
+        exit(-1);
+
+    FILE* fp = fopen(opts.fname, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", opts.fname);
+        exit(-1);
+    }
+    int binary, n;
+    float scale;
+    if (read_header(fp, &binary, &n, &scale) != 0 || n < 0 || scale <= 0) {
+        fprintf(stderr, "Bad header in %s\n", opts.fname);
+        exit(-1);
+    }
+    init_ramp();
+    init_crc();
+
+    int nthreads = omp_get_max_threads();
+    int nbatch = BATCH_PER_THREAD * nthreads;
+    frame_t* batch = (frame_t*) calloc(nbatch, sizeof(frame_t));
+    for (int k = 0; k < nbatch; ++k) {
+        batch[k].x = (float*) malloc(n * sizeof(float));
+        batch[k].y = (float*) malloc(n * sizeof(float));
+        batch[k].c = (int*)   malloc(n * sizeof(int));
+    }
+    uint32_t* buf = (uint32_t*) malloc(3 * (size_t) n * sizeof(uint32_t));
+    size_t fb_size = 3 * (size_t) opts.size * opts.size;
+    uint8_t* fbs = (uint8_t*) malloc(nthreads * fb_size);
+
+    int nframes = 0, nwritten = 0, nfail = 0, done = 0;
+    while (!done) {
+        int m = 0;
+        while (m < nbatch) {
+            if (!read_frame(fp, binary, n, &batch[m], buf)) {
+                done = 1;
+                break;
+            }
+            batch[m].index = nframes;
+            if (nframes++ % opts.every == 0)
+                ++m;
+        }
+
+        #pragma omp parallel for schedule(dynamic) reduction(+:nfail)
+        for (int k = 0; k < m; ++k) {
+            uint8_t* rgb = fbs + omp_get_thread_num() * fb_size;
+            rasterize(rgb, opts.size, opts.radius, scale, n, &batch[k]);
+            nfail += (write_image(&opts, batch[k].index, rgb) != 0);
+        }
+        nwritten += m;
+    }
+    fclose(fp);
+    printf("Rendered %d of %d frames (%d failed)\n",
+           nwritten - nfail, nframes, nfail);
+
+    for (int k = 0; k < nbatch; ++k) {
+        free(batch[k].c);
+        free(batch[k].y);
+        free(batch[k].x);
+    }
+    free(batch);
+    free(buf);
+    free(fbs);
+    return nfail ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "buckets.h"
+#include "scenario.h"
+#include "adapt.h"
+
+/*@q
+ * ====================================================================
+ */
+
+/*@T
+ * \section{Initialization}
+ *
+ * We've hard coded the computational domain to a unit box, but we'd prefer
+ * to do something more flexible for the initial distribution of fluid.
+ * In particular, we define the initial geometry of the fluid in terms of an
+ * {\em indicator function} that is one for points in the domain occupied
+ * by fluid and zero elsewhere.  A [[domain_fun_t]] is a pointer to an
+ * indicator for a domain, which is a function that takes two floats and
+ * returns 0 or 1.  Two examples of indicator functions are a little box
+ * of fluid in the corner of the domain and a circular drop.
+ *@c*/
+int box_indicator(float x, float y)
+{
+	return (x < 0.5) && (y < 0.5);
+}
+
+int circ_indicator(float x, float y)
+{
+	float dx = (x-0.5);
+	float dy = (y-0.3);
+	float r2 = dx*dx + dy*dy;
+	return (r2 < 0.25*0.25);
+}
+
+/*@T
+ *
+ * The benchmark suite adds a few geometries chosen to stress different
+ * parts of the code: a tall dam break column, a drop centered in the
+ * box, a domain that is completely full (the worst case for the
+ * density and force loops, since every cell is crowded), and a sparse
+ * splash of small droplets (the worst case for load balance, since
+ * most cells are empty and the occupied ones are unevenly spread).
+ *@c*/
+int dam_indicator(float x, float y)
+{
+	return (x < 0.25) && (y < 0.8);
+}
+
+int drop_indicator(float x, float y)
+{
+	float dx = (x-0.5);
+	float dy = (y-0.5);
+	float r2 = dx*dx + dy*dy;
+	return (r2 < 0.2*0.2);
+}
+
+int uniform_indicator(float x, float y)
+{
+	return 1;
+}
+
+int splash_indicator(float x, float y)
+{
+	static const float drops[][2] = {
+		{0.15, 0.85}, {0.30, 0.60}, {0.45, 0.90}, {0.80, 0.70}, {0.70, 0.35}
+	};
+	for (int i = 0; i < sizeof(drops)/sizeof(drops[0]); ++i) {
+		float dx = (x-drops[i][0]);
+		float dy = (y-drops[i][1]);
+		if (dx*dx + dy*dy < 0.06*0.06)
+			return 1;
+	}
+	return 0;
+}
+
+typedef struct scenario_t {
+	const char*  name;
+	domain_fun_t indicatef;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{"box",     box_indicator},
+	{"circ",    circ_indicator},
+	{"dam",     dam_indicator},
+	{"drop",    drop_indicator},
+	{"uniform", uniform_indicator},
+	{"splash",  splash_indicator}
+};
+
+int scenario_count(void)
+{
+	return sizeof(scenarios)/sizeof(scenarios[0]);
+}
+
+const char* scenario_name(int i)
+{
+	return scenarios[i].name;
+}
+
+/*@T
+ *
+ * The [[place_particles]] routine fills a region (indicated by the
+ * [[indicatef]] argument) with fluid particles.  The fluid particles
+ * are placed at points inside the domain that lie on a regular mesh
+ * with cell sizes of $h/1.3$.  This is close enough to allow the
+ * particles to overlap somewhat, but not too much.
+ *@c*/
+sim_state_t* place_particles(sim_param_t* param,
+		domain_fun_t indicatef)
+{
+	float h  = param->h;
+	float hh = h/1.3;
+
+	// Count mesh points that fall in indicated region.
+	int count = 0;
+	for (float x = 0; x < 1; x += hh)
+		for (float y = 0; y < 1; y += hh)
+			count += indicatef(x,y);
+
+	// Populate the particle data structure
+	sim_state_t* s = alloc_state(count, param);
+	int p = 0;
+	for (float x = 0; x < 1; x += hh) {
+		for (float y = 0; y < 1; y += hh) {
+			if (indicatef(x,y)) {
+				s->x[p]  = x;
+				s->y[p]  = y;
+				s->vx[p] = 0;
+				s->vy[p] = 0;
+				++p;
+			}
+		}
+	}
+	return s;
+}
+
+/*@T
+ *
+ * The [[place_particle]] routine determines the initial particle
+ * placement, but not the desired mass.  We want the fluid in the
+ * initial configuration to exist roughly at the reference density.
+ * One way to do this is to take the volume in the indicated body of
+ * fluid, multiply by the mass density, and divide by the number of
+ * particles; but that requires that we be able to compute the volume
+ * of the fluid region.  Alternately, we can simply compute the
+ * average mass density assuming each particle has mass one, then use
+ * that to compute the particle mass necessary in order to achieve the
+ * desired reference density.  We do this with [[normalize_mass]].
+ * With adaptive resolution, it starts every particle out unmerged,
+ * with unit mass and size $h$, and scales the per-particle masses too.
+ * @c*/
+void normalize_mass(sim_state_t* s, sim_param_t* param)
+{
+	s->mass = 1;
+	if (s->m) {
+		for (int i = 0; i < s->n; ++i) {
+			s->m[i]  = 1;
+			s->hs[i] = param->h;
+		}
+	}
+	compute_density(s, param);
+	float rho0 = param->rho0;
+	float rho2s = 0;
+	float rhos  = 0;
+	for (int i = 0; i < s->n; ++i) {
+		rho2s += (s->rho[i])*(s->rho[i]);
+		rhos  += s->rho[i];
+	}
+	s->mass *= ( rho0*rhos / rho2s );
+	if (s->m)
+		for (int i = 0; i < s->n; ++i)
+			s->m[i] *= ( rho0*rhos / rho2s );
+}
+
+sim_state_t* init_particles(sim_param_t* param)
+{
+	domain_fun_t indicatef = NULL;
+	for (int i = 0; i < scenario_count(); ++i)
+		if (strcmp(param->scenario, scenarios[i].name) == 0)
+			indicatef = scenarios[i].indicatef;
+	if (indicatef == NULL) {
+		fprintf(stderr, "Unknown scenario: %s\n", param->scenario);
+		return NULL;
+	}
+
+	sim_state_t* s = place_particles(param, indicatef);
+	build_bins(s, param);
+	normalize_mass(s, param);
+	if (param->adaptive)
+		adapt_resolution(s, param);
+	return s;
+}
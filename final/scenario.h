@@ -0,0 +1,25 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{Scenarios}
+ *
+ * A scenario names an initial fluid geometry.  The [[init_particles]]
+ * routine looks up [[params->scenario]] in the scenario table, places
+ * and bins the particles, and normalizes the mass; it returns [[NULL]]
+ * if the name is unknown.  The benchmark driver walks the same table
+ * via [[scenario_count]] and [[scenario_name]].
+ *@c*/
+typedef int (*domain_fun_t)(float, float);
+
+sim_state_t* init_particles(sim_param_t* param);
+void normalize_mass(sim_state_t* s, sim_param_t* param);
+
+int scenario_count(void);
+const char* scenario_name(int i);
+
+/*@q*/
+#endif /* SCENARIO_H */
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "io.h"
+#include "sink.h"
+
+/*@T
+ * \subsection{The frame queue}
+ *
+ * Frames are encoded into memory with [[open_memstream]], so the sink
+ * uses whichever of [[io_bin.c]] and [[io_txt.c]] the output file
+ * does, and the encoded buffers go into a ring of [[depth]]
+ * slots.  The simulation thread only ever holds the lock long enough
+ * to swap a pointer.  The writer thread takes the oldest frame, sends
+ * it, and frees it; all blocking (waiting for a viewer, slow writes)
+ * happens there.  When a viewer goes away, the writer waits for the
+ * next one.  While it waits, new frames push out old ones, so a viewer
+ * that attaches late starts close to the present.
+ *
+ * A viewer that stays connected but stops reading must not hold up
+ * the end of the run either, so connections to a FIFO or socket are
+ * non-blocking, and the writer waits for room with [[poll]], at most
+ * [[POLL_MS]] at a time, checking whether the sink is closing.  Once
+ * it is, the writer keeps sending for at most [[DRAIN_MS]]; whatever
+ * has not gone out by then, including the frame it was sending, is
+ * counted as dropped.  Standard output is the exception: it is the
+ * run's own output stream, shared with whoever started us, so it stays
+ * blocking and [[sink_close]] waits until everything queued is written,
+ * just as it would for the output file.
+ *@c*/
+#define POLL_MS  100
+#define DRAIN_MS 1000
+
+typedef struct frame_buf_t {
+    char*  data;
+    size_t len;
+} frame_buf_t;
+
+struct frame_sink_t {
+    int    kind;          /* SINK_STDOUT, SINK_FIFO or SINK_UNIX */
+    char*  path;
+    const io_format_t* io;
+    int    listen_fd;     /* Listening socket (unix only)  */
+    int    fd;            /* Connection, or -1             */
+    frame_buf_t header;
+    frame_buf_t* queue;   /* Ring of depth slots           */
+    int    depth, head, count;
+    int    dropped;
+    int    closing;
+    double t_close;       /* When closing was set (s)      */
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    pthread_t writer;
+};
+
+enum { SINK_STDOUT, SINK_FIFO, SINK_UNIX };
+
+int sink_is_stdout(const char* spec)
+{
+    return strcmp(spec, "-") == 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Past the drain deadline after sink_close? */
+static int given_up(frame_sink_t* sink)
+{
+    pthread_mutex_lock(&sink->lock);
+    int late = sink->closing && now() - sink->t_close > DRAIN_MS * 1e-3;
+    pthread_mutex_unlock(&sink->lock);
+    return late;
+}
+
+static int write_all(frame_sink_t* sink, const char* p, size_t len)
+{
+    while (len > 0) {
+        ssize_t k = write(sink->fd, p, len);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (given_up(sink))
+                return -1;
+            struct pollfd pfd = { sink->fd, POLLOUT, 0 };
+            poll(&pfd, 1, POLL_MS);
+            continue;
+        }
+        if (k <= 0)
+            return -1;
+        p += k;
+        len -= k;
+    }
+    return 0;
+}
+
+/* Wait for a viewer; returns an fd, or -1 if the sink is closing */
+static int attach(frame_sink_t* sink)
+{
+    if (sink->kind == SINK_STDOUT)
+        return STDOUT_FILENO;
+    while (1) {
+        pthread_mutex_lock(&sink->lock);
+        int closing = sink->closing;
+        pthread_mutex_unlock(&sink->lock);
+        if (closing)
+            return -1;
+        if (sink->kind == SINK_FIFO) {
+            // Opening a FIFO without a reader fails with ENXIO
+            int fd = open(sink->path, O_WRONLY | O_NONBLOCK);
+            if (fd >= 0)
+                return fd;
+            poll(NULL, 0, POLL_MS);
+        } else {
+            struct pollfd pfd = { sink->listen_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, POLL_MS) > 0) {
+                int fd = accept(sink->listen_fd, NULL, NULL);
+                if (fd >= 0) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    return fd;
+                }
+            }
+        }
+    }
+}
+
+static void* writer_main(void* arg)
+{
+    frame_sink_t* sink = (frame_sink_t*) arg;
+    while (1) {
+        if (sink->fd < 0) {
+            sink->fd = attach(sink);
+            if (sink->fd < 0)
+                break;
+            if (write_all(sink, sink->header.data, sink->header.len) < 0)
+                goto detach;
+        }
+
+        pthread_mutex_lock(&sink->lock);
+        while (sink->count == 0 && !sink->closing)
+            pthread_cond_wait(&sink->ready, &sink->lock);
+        if (sink->count == 0) {
+            pthread_mutex_unlock(&sink->lock);
+            break;
+        }
+        frame_buf_t f = sink->queue[sink->head];
+        sink->head = (sink->head + 1) % sink->depth;
+        sink->count--;
+        pthread_mutex_unlock(&sink->lock);
+
+        int status = write_all(sink, f.data, f.len);
+        free(f.data);
+        if (status == 0)
+            continue;
+        pthread_mutex_lock(&sink->lock);
+        sink->dropped++;
+        pthread_mutex_unlock(&sink->lock);
+    detach:
+        if (sink->kind != SINK_STDOUT)
+            close(sink->fd);
+        sink->fd = -1;
+        if (sink->kind == SINK_STDOUT || given_up(sink))
+            break;
+    }
+    return NULL;
+}
+
+static int open_unix(const char* path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+frame_sink_t* sink_open(const char* spec, const io_format_t* io, int n,
+                        int depth)
+{
+    frame_sink_t* sink = (frame_sink_t*) calloc(1, sizeof(frame_sink_t));
+    sink->io = io;
+    sink->fd = -1;
+    sink->listen_fd = -1;
+    if (sink_is_stdout(spec)) {
+        sink->kind = SINK_STDOUT;
+    } else if (strncmp(spec, "fifo:", 5) == 0) {
+        sink->kind = SINK_FIFO;
+        sink->path = strdup(spec+5);
+        if (mkfifo(sink->path, 0666) < 0 && errno != EEXIST)
+            goto fail;
+    } else if (strncmp(spec, "unix:", 5) == 0) {
+        sink->kind = SINK_UNIX;
+        sink->path = strdup(spec+5);
+        sink->listen_fd = open_unix(sink->path);
+        if (sink->listen_fd < 0)
+            goto fail;
+    } else {
+        fprintf(stderr, "Live output must be -, fifo:path or unix:path\n");
+        free(sink);
+        return NULL;
+    }
+
+    // A viewer that goes away should not kill the simulation
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE* fp = open_memstream(&sink->header.data, &sink->header.len);
+    io->write_header(fp, n);
+    fclose(fp);
+
+    sink->depth = depth > 0 ? depth : 1;
+    sink->queue = (frame_buf_t*) calloc(sink->depth, sizeof(frame_buf_t));
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->ready, NULL);
+    pthread_create(&sink->writer, NULL, writer_main, sink);
+    return sink;
+
+ fail:
+    fprintf(stderr, "Could not open live output %s: %s\n",
+            spec, strerror(errno));
+    free(sink->path);
+    free(sink);
+    return NULL;
+}
+
+int sink_frame(frame_sink_t* sink, int n, float* x, float* y, int* c)
+{
+    frame_buf_t f;
+    FILE* fp = open_memstream(&f.data, &f.len);
+    sink->io->write_frame_data(fp, n, x, y, c);
+    fclose(fp);
+
+    pthread_mutex_lock(&sink->lock);
+    if (sink->count == sink->depth) {
+        free(sink->queue[sink->head].data);
+        sink->head = (sink->head + 1) % sink->depth;
+        sink->count--;
+        sink->dropped++;
+    }
+    sink->queue[(sink->head + sink->count) % sink->depth] = f;
+    sink->count++;
+    int dropped = sink->dropped;
+    pthread_cond_signal(&sink->ready);
+    pthread_mutex_unlock(&sink->lock);
+    return dropped;
+}
+
+void sink_close(frame_sink_t* sink, FILE* log)
+{
+    pthread_mutex_lock(&sink->lock);
+    sink->closing = 1;
+    sink->t_close = now();
+    pthread_cond_signal(&sink->ready);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->writer, NULL);
+
+    // Frames left behind had no viewer to go to
+    for (; sink->count > 0; sink->count--) {
+        free(sink->queue[sink->head].data);
+        sink->head = (sink->head + 1) % sink->depth;
+        sink->dropped++;
+    }
+    if (sink->fd >= 0 && sink->kind != SINK_STDOUT)
+        close(sink->fd);
+    if (sink->listen_fd >= 0) {
+        close(sink->listen_fd);
+        unlink(sink->path);
+    }
+    if (sink->dropped)
+        fprintf(log, "Live output dropped %d frames\n", sink->dropped);
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->ready);
+    free(sink->header.data);
+    free(sink->queue);
+    free(sink->path);
+    free(sink);
+}
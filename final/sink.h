@@ -0,0 +1,37 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdio.h>
+#include "io.h"
+
+/*@T
+ * \section{Live output}
+ *
+ * A frame sink publishes frames to a viewer while the simulation runs.
+ * The [[spec]] passed to [[sink_open]] names where they go:
+ * \begin{itemize}
+ * \item [[-]] writes to standard output;
+ * \item [[fifo:path]] writes to a named pipe, creating it if needed;
+ * \item [[unix:path]] listens on a Unix domain socket, one viewer at
+ *   a time.
+ * \end{itemize}
+ * Frames are encoded in the same format [[io]] as the output file, and
+ * every viewer that attaches gets the header first.  The [[sink_frame]] call
+ * never blocks: frames wait in a queue of [[depth]] entries for a
+ * writer thread, and if the viewer falls behind, the oldest queued
+ * frame is dropped to make room.  It returns the number of frames
+ * dropped so far.  [[sink_close]] sends what is queued if a viewer is
+ * attached (for at most a second, unless the viewer is on standard
+ * output), stops the writer and reports the number of dropped frames
+ * on [[log]].
+ *@c*/
+typedef struct frame_sink_t frame_sink_t;
+
+frame_sink_t* sink_open(const char* spec, const io_format_t* io, int n,
+                        int depth);
+int  sink_frame(frame_sink_t* sink, int n, float* x, float* y, int* c);
+void sink_close(frame_sink_t* sink, FILE* log);
+int  sink_is_stdout(const char* spec);
+
+/*@q*/
+#endif /* SINK_H */
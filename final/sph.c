@@ -2,7 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <assert.h>
+#include <errno.h>
 
 #include "io.h"
 #include "params.h"
@@ -11,128 +11,93 @@
 #include "leapfrog.h"
 #include "timing.h"
 #include "buckets.h"
+#include "scenario.h"
+#include "perfctr.h"
+#include "trace.h"
+#include "metrics.h"
+#include "adapt.h"
+#include "step.h"
+#include "channel.h"
+#include "sink.h"
+#include "tune.h"
 
 /*@q
  * ====================================================================
  */
 
 /*@T
- * \section{Initialization}
- *
- * We've hard coded the computational domain to a unit box, but we'd prefer
- * to do something more flexible for the initial distribution of fluid.
- * In particular, we define the initial geometry of the fluid in terms of an
- * {\em indicator function} that is one for points in the domain occupied
- * by fluid and zero elsewhere.  A [[domain_fun_t]] is a pointer to an
- * indicator for a domain, which is a function that takes two floats and
- * returns 0 or 1.  Two examples of indicator functions are a little box
- * of fluid in the corner of the domain and a circular drop.
- *@c*/
-typedef int (*domain_fun_t)(float, float);
-
-int box_indicator(float x, float y)
-{
-	return (x < 0.5) && (y < 0.5);
-}
-
-int circ_indicator(float x, float y)
-{
-	float dx = (x-0.5);
-	float dy = (y-0.3);
-	float r2 = dx*dx + dy*dy;
-	return (r2 < 0.25*0.25);
-}
-
-/*@T
+ * \section{The [[main]] event}
  *
- * The [[place_particles]] routine fills a region (indicated by the
- * [[indicatef]] argument) with fluid particles.  The fluid particles
- * are placed at points inside the domain that lie on a regular mesh
- * with cell sizes of $h/1.3$.  This is close enough to allow the
- * particles to overlap somewhat, but not too much.
+ * The [[main]] routine sets up the run, takes the special first
+ * leapfrog step, and hands the time step loop to [[run_steps]],
+ * which calls [[write_frame]] to write out a frame for visualization
+ * every few steps.  With adaptive resolution, particles are split and
+ * merged once per frame, and frames are written through [[adapt_frame]]
+ * so that every frame has the same number of points.  With an output
+ * channel selected, [[channel_quantize]] fills the color slot.  Frames
+ * also go to the live sink, if there is one; when that is standard
+ * output, the run summary goes to standard error instead.  With
+ * tracing on, each thread keeps its last [[TRACE_EVENTS]] phases.
+ * With a metrics output, every frame also publishes the run's
+ * progress, the phase times, and the largest density and speed.
  *@c*/
-sim_state_t* place_particles(sim_param_t* param, 
-		domain_fun_t indicatef)
+#define LIVE_DEPTH 4   /* Frames queued for a live viewer */
+#define TRACE_EVENTS (1 << 16)   /* Traced phases kept per thread */
+
+typedef struct frame_out_t {
+	FILE*  fp;
+	const io_format_t* io;
+	int    n;
+	float* x;
+	float* y;
+	int*   c;
+	int*   q;      /* Channel values, one per particle */
+	frame_sink_t* live;
+	metrics_t* metrics;
+	long long frames;
+	double particle_steps;
+} frame_out_t;
+
+static void publish_metrics(sim_state_t* s, sim_param_t* params,
+                            frame_out_t* out)
 {
-	float h  = param->h;
-	float hh = h/1.3;
-
-	// Count mesh points that fall in indicated region.
-	int count = 0;
-	for (float x = 0; x < 1; x += hh)
-		for (float y = 0; y < 1; y += hh)
-			count += indicatef(x,y);
-
-	// Populate the particle data structure
-	sim_state_t* s = alloc_state(count, h);
-	int p = 0;
-	for (float x = 0; x < 1; x += hh) {
-		for (float y = 0; y < 1; y += hh) {
-			if (indicatef(x,y)) {
-				s->x[2*p+0] = x;
-				s->x[2*p+1] = y;
-				s->v[2*p+0] = 0;
-				s->v[2*p+1] = 0;
-				++p;
-			}
-		}
+	metrics_sample_t ms;
+	int n = s->n;
+	ms.frames = ++out->frames;
+	ms.steps  = (ms.frames-1) * (long long) params->npframe;
+	if (ms.frames > 1)
+		out->particle_steps += (double) n * params->npframe;
+	ms.particle_steps = out->particle_steps;
+	ms.bytes = ftell(out->fp);
+	ms.n     = n;
+	ms.dt    = params->dt;
+	float rho_max = 0, v2_max = 0;
+	for (int i = 0; i < n; ++i) {
+		float v2 = s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i];
+		if (s->rho[i] > rho_max)
+			rho_max = s->rho[i];
+		if (v2 > v2_max)
+			v2_max = v2;
 	}
-	return s;    
+	ms.rho_max   = rho_max;
+	ms.speed_max = sqrt(v2_max);
+	for (int p = 0; p < NPHASES; ++p)
+		ms.phase[p] = trace_busy(p);
+	metrics_update(out->metrics, &ms);
 }
 
-/*@T
- *
- * The [[place_particle]] routine determines the initial particle
- * placement, but not the desired mass.  We want the fluid in the
- * initial configuration to exist roughly at the reference density.
- * One way to do this is to take the volume in the indicated body of
- * fluid, multiply by the mass density, and divide by the number of
- * particles; but that requires that we be able to compute the volume
- * of the fluid region.  Alternately, we can simply compute the
- * average mass density assuming each particle has mass one, then use
- * that to compute the particle mass necessary in order to achieve the
- * desired reference density.  We do this with [[normalize_mass]].
- * @c*/
-void normalize_mass(sim_state_t* s, sim_param_t* param)
+static void write_frame(sim_state_t* s, sim_param_t* params, void* data)
 {
-	s->mass = 1;
-	compute_density(s, param);
-	float rho0 = param->rho0;
-	float rho2s = 0;
-	float rhos  = 0;
-	for (int i = 0; i < s->n; ++i) {
-		rho2s += (s->rho[i])*(s->rho[i]);
-		rhos  += s->rho[i];
-	}
-	s->mass *= ( rho0*rhos / rho2s );
-}
-
-sim_state_t* init_particles(sim_param_t* param)
-{
-	sim_state_t* s = place_particles(param, box_indicator);
-	build_bins(s, param);
-	normalize_mass(s, param);
-	return s;
-}
-
-/*@T
- * \section{The [[main]] event}
- *
- * The [[main]] routine actually runs the time step loop, writing
- * out files for visualization every few steps.  For debugging
- * convenience, we use [[check_state]] before writing out frames,
- * just so that we don't spend a lot of time on a simulation that
- * has gone berserk.
- *@c*/
-
-void check_state(sim_state_t* s)
-{
-	for (int i = 0; i < s->n; ++i) {
-		float xi = s->x[2*i+0];
-		float yi = s->x[2*i+1];
-		assert( xi >= 0 && xi <= 1 );
-		assert( yi >= 0 && yi <= 1 );
-	}
+	frame_out_t* out = (frame_out_t*) data;
+	if (out->q)
+		channel_quantize(s, params, out->q);
+	if (params->adaptive)
+		adapt_frame(s, params, out->x, out->y, out->c, out->q);
+	out->io->write_frame_data(out->fp, out->n, out->x, out->y, out->c);
+	if (out->live)
+		sink_frame(out->live, out->n, out->x, out->y, out->c);
+	if (out->metrics)
+		publish_metrics(s, params, out);
 }
 
 int main(int argc, char** argv)
@@ -140,45 +105,107 @@ int main(int argc, char** argv)
 	sim_param_t params;
 	if (get_params(argc, argv, &params) != 0)
 		exit(-1);
+	// Check the format before opening (and truncating) the output file
+	const io_format_t* io = io_lookup(params.format);
+	if (io == NULL) {
+		fprintf(stderr, "Unknown output format: %s\n", params.format);
+		exit(-1);
+	}
+	if (params.affinity)
+		bind_threads();
 	sim_state_t* state = init_particles(&params);
+	if (state == NULL)
+		exit(-1);
+	if (params.tune)
+		state = autotune(state, &params);
 
-	FILE* fp    = fopen(params.fname, "w");
 	int nframes = params.nframes;
 	int npframe = params.npframe;
 	float dt    = params.dt;
-	int n       = state->n;
+	double particle_steps = state->n;
+
+	frame_out_t out = { fopen(params.fname, "w"), io,
+	                    state->nmax, state->x, state->y, NULL, NULL, NULL };
+	if (out.fp == NULL) {
+		fprintf(stderr, "Could not open output file %s: %s\n",
+		        params.fname, strerror(errno));
+		exit(-1);
+	}
+	FILE* log = stdout;
+	if (params.live) {
+		out.live = sink_open(params.live, out.io, out.n, LIVE_DEPTH);
+		if (out.live == NULL)
+			exit(-1);
+		if (sink_is_stdout(params.live))
+			log = stderr;
+	}
+	if (params.metrics) {
+		out.metrics = metrics_open(params.metrics);
+		if (out.metrics == NULL)
+			exit(-1);
+	}
+	if (params.channel != CHANNEL_NONE) {
+		out.q = (int*) malloc(out.n * sizeof(int));
+		compute_density(state, &params);
+	}
+	if (params.adaptive) {
+		out.x = (float*) malloc(out.n * sizeof(float));
+		out.y = (float*) malloc(out.n * sizeof(float));
+		out.c = (int*)   malloc(out.n * sizeof(int));
+	} else {
+		out.c = out.q;
+	}
+
+	if (params.perfctr)
+		perf_init();
+	if (params.trace || params.metrics)
+		trace_init(params.trace ? TRACE_EVENTS : 0);
 
 	tic(0);
-	write_header(fp, n);
-	write_frame_data(fp, n, state->x, NULL);
+	perf_begin(PHASE_OUTPUT);
+	out.io->write_header(out.fp, out.n);
+	write_frame(state, &params, &out);
+	perf_end(PHASE_OUTPUT);
 
 	compute_accel(state, &params);
-	leapfrog_start(state, dt);
+	perf_begin(PHASE_INTEGRATE);
+	leapfrog_start(state, &params, dt);
 	check_state(state);
+	perf_end(PHASE_INTEGRATE);
 	if (update_bins(state, &params) < 0) {
 		return -1;
 	}
+	perf_begin(PHASE_REBIN);
 	if (optimize_bins(state, &params, 1) < 0) {
 		return -1;
 	}
-
-	for (int frame = 1; frame < nframes; ++frame) {
-		for (int i = 0; i < npframe; ++i) {
-			compute_accel(state, &params);
-			leapfrog_step(state, dt);
-			check_state(state);
-			if (update_bins(state, &params) < 0) {
-				return -1;
-			}
-		}
-		if (optimize_bins(state, &params, 0) < 0) {
-			return -1;
-		}
-		write_frame_data(fp, n, state->x, NULL);
+	perf_end(PHASE_REBIN);
+
+	particle_steps += run_steps(state, &params, (nframes-1) * npframe,
+	                            write_frame, &out);
+
+	fprintf(log, "(%d particles) Ran in %g seconds\n", state->n, toc(0));
+	if (params.implicit > 0)
+		fprintf(log, "%.3g pressure iterations per step\n",
+		        (double) state->iters / ((nframes-1) * npframe + 1));
+	perf_report(log, particle_steps);
+	perf_finalize();
+	if (params.trace) {
+		trace_report(log);
+		trace_write(params.trace);
 	}
-	printf("(%d particles) Ran in %g seconds\n", state->n, toc(0));
-
-	fclose(fp);
+	trace_finalize();
+
+	if (out.live)
+		sink_close(out.live, log);
+	if (out.metrics)
+		metrics_close(out.metrics);
+	fclose(out.fp);
+	if (params.adaptive) {
+		free(out.c);
+		free(out.y);
+		free(out.x);
+	}
+	free(out.q);
 	free_state(state);
 }
-
@@ -1,32 +1,289 @@
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <omp.h>
 #include "state.h"
+#include "channel.h"
 
-sim_state_t* alloc_state(int n, float h)
+/*@T
+ * \subsection{Allocation}
+ *
+ * Cells are [[params->cell]] times $h$ wide, rounded up so that a
+ * whole number of them spans the box.  The kernels only need cells at
+ * least $h$ wide; the default of $2h$ leaves room for the larger
+ * merged particles of adaptive runs.  Wider cells are always safe, so
+ * the grid is capped at [[MAX_CELLS_ACROSS]] cells on a side, which
+ * keeps the cell count and the per-thread count table well inside
+ * [[int]] range at tiny $h$.  The sparse grid only stores occupied
+ * cells, so it allows a finer grid, up to [[MAX_SPARSE_ACROSS]] cells
+ * on a side, which still keeps grid cell numbers inside [[int]] range.
+ *
+ * All per-particle arrays come from [[alloc_array]], which returns
+ * storage aligned to a cache line.  With [[hugepages]] set, the
+ * storage is aligned to a 2MB boundary and we ask the kernel to back
+ * it with transparent huge pages, which cuts TLB misses for large
+ * runs; if the kernel does not support that, we silently fall back
+ * to ordinary pages.  Huge pages are only used for arrays of at least
+ * one huge page.  The per-thread and per-cell tables of a small grid,
+ * and every array of a small run, fit in a few ordinary pages, and
+ * rounding each of them up to 2MB would only waste memory.
+ *
+ * Note that [[alloc_array]] does {\em not} zero the storage.  Linux
+ * places a page on the NUMA node of the thread that first writes to
+ * it, so zeroing everything from the main thread (as [[calloc]] does)
+ * would put the whole particle state on one socket.  Instead,
+ * [[first_touch]] zeros the arrays in parallel with the same static
+ * partition over particles that the time step loops use, so each
+ * thread's share of the particles lands in its own local memory.
+ *@c*/
+#define CACHE_LINE 64
+#define HUGE_PAGE  (2 << 20)
+#define MAX_CELLS_ACROSS 16384
+#define MAX_SPARSE_ACROSS 32768
+#define HASH_MIN_SLOTS 64
+
+static void* alloc_array(size_t nbytes, int hugepages)
+{
+    void* p = NULL;
+    if (nbytes < HUGE_PAGE)
+        hugepages = 0;
+    size_t align = hugepages ? HUGE_PAGE : CACHE_LINE;
+    if (nbytes == 0)
+        nbytes = CACHE_LINE;
+    if (hugepages)
+        nbytes = (nbytes + HUGE_PAGE-1) & ~((size_t) HUGE_PAGE-1);
+    if (posix_memalign(&p, align, nbytes) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (hugepages)
+        madvise(p, nbytes, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void first_touch(sim_state_t* s, int npad)
 {
-    int MAX =  (int) (1 / (2 * h));
+    int n = s->n;
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < npad; ++i) {
+        s->rho[i] = 0;
+        s->x[i]   = s->y[i]   = 0;
+        s->vhx[i] = s->vhy[i] = 0;
+        s->vx[i]  = s->vy[i]  = 0;
+        s->ax[i]  = s->ay[i]  = 0;
+        if (s->m)
+            s->m[i] = s->hs[i] = 0;
+        if (s->nnb)
+            s->nnb[i] = 0;
+        if (s->p)
+            s->p[i] = s->apx[i] = s->apy[i] = s->res[i] = 0;
+        if (i < n) {
+            s->bin_ids[i] = i;
+            s->arena.cell[i] = -1;
+        }
+    }
+#pragma omp parallel for schedule(static)
+    for (int b = 0; b <= s->bin_size; ++b) {
+        s->bin_start[b] = 0;
+        for (int t = 0; t <= s->arena.nthreads && b < s->bin_size; ++t)
+            s->arena.counts[(size_t) t*s->bin_size + b] = 0;
+    }
+}
+
+sim_state_t* alloc_state(int n, sim_param_t* params)
+{
+    int hp  =  params->hugepages;
+    int MAX =  (int) (1 / (params->cell * params->h));
+    if (MAX < 1) MAX = 1;
+    if (MAX > MAX_CELLS_ACROSS && !params->sparse) MAX = MAX_CELLS_ACROSS;
+    if (MAX > MAX_SPARSE_ACROSS) MAX = MAX_SPARSE_ACROSS;
+    int npad = (n + STATE_PAD-1) / STATE_PAD * STATE_PAD;
+    size_t nb = npad * sizeof(float);
     sim_state_t* s = (sim_state_t*) calloc(1, sizeof(sim_state_t));
     s->n   =  n;
+    s->nmax = n;
     s->MAX =  MAX;
-    s->bin_size = MAX * MAX;
-    s->ps = (particle_t*) calloc(n, sizeof(particle_t));
-    s->bins = (bin_t*) calloc(MAX*MAX, sizeof(bin_t));
-    s->rho =  (float*) calloc(  n, sizeof(float));
-    s->x =    (float*) calloc(2*n, sizeof(float));
-    s->vh =   (float*) calloc(2*n, sizeof(float));
-    s->v =    (float*) calloc(2*n, sizeof(float));
-    s->a =    (float*) calloc(2*n, sizeof(float));
+    s->bin_size = params->sparse ? 0 : MAX * MAX;
+    s->arena.nthreads = omp_get_max_threads();
+    s->arena.cell   = (int*) alloc_array(n*sizeof(int), hp);
+    reserve_bins(s, params, s->bin_size);
+    if (params->sparse)
+        reserve_hash(s, params, HASH_MIN_SLOTS);
+    s->bin_ids   = (int*) alloc_array(n*sizeof(int), hp);
+    s->rho = (float*) alloc_array(nb, hp);
+    s->x   = (float*) alloc_array(nb, hp);
+    s->y   = (float*) alloc_array(nb, hp);
+    s->vhx = (float*) alloc_array(nb, hp);
+    s->vhy = (float*) alloc_array(nb, hp);
+    s->vx  = (float*) alloc_array(nb, hp);
+    s->vy  = (float*) alloc_array(nb, hp);
+    s->ax  = (float*) alloc_array(nb, hp);
+    s->ay  = (float*) alloc_array(nb, hp);
+    if (params->adaptive) {
+        s->m  = (float*) alloc_array(nb, hp);
+        s->hs = (float*) alloc_array(nb, hp);
+    }
+    if (params->channel == CHANNEL_NEIGHBORS)
+        s->nnb = (int*) alloc_array(npad * sizeof(int), hp);
+    if (params->implicit > 0) {
+        s->p   = (float*) alloc_array(nb, hp);
+        s->apx = (float*) alloc_array(nb, hp);
+        s->apy = (float*) alloc_array(nb, hp);
+        s->res = (float*) alloc_array(nb, hp);
+    }
+    first_touch(s, npad);
     return s;
 }
 
+/*@T
+ *
+ * The [[reserve_bins]] routine makes room for [[nbins]] bins: the
+ * start offsets, the per-thread count table, and on the sparse grid
+ * the bin keys.  The dense grid calls it once, for every cell; the
+ * sparse grid calls it at each rebinning with the number of occupied
+ * cells, and it at least doubles the room whenever it has to grow, so
+ * reallocations are rare.  The old contents are not kept, since
+ * rebinning rewrites all of them.  Likewise, [[reserve_hash]] gives
+ * the sparse grid's hash table [[cap]] slots, and [[reserve_active]]
+ * makes room for [[ncells]] occupied cells in the active list, which
+ * grows the same way.
+ *@c*/
+void reserve_bins(sim_state_t* s, sim_param_t* params, int nbins)
+{
+    int hp = params->hugepages;
+    if (s->bin_start && nbins <= s->bin_cap)
+        return;
+    if (s->bin_start && nbins < 2*s->bin_cap)
+        nbins = 2*s->bin_cap;
+    free(s->bin_start);
+    free(s->bin_key);
+    free(s->arena.counts);
+    s->bin_cap = nbins;
+    s->arena.counts = (int*) alloc_array(((size_t) (s->arena.nthreads+1) *
+                                          nbins + s->arena.nthreads) *
+                                         sizeof(int), hp);
+    s->bin_start = (int*) alloc_array((nbins+1) * sizeof(int), hp);
+    s->bin_key = NULL;
+    if (params->sparse)
+        s->bin_key = (int*) alloc_array(nbins * sizeof(int), hp);
+}
+
+void reserve_hash(sim_state_t* s, sim_param_t* params, int cap)
+{
+    free(s->hash.slots);
+    s->hash.cap = cap;
+    s->hash.slots = (int*) alloc_array(2 * (size_t) cap * sizeof(int),
+                                       params->hugepages);
+}
+
+void reserve_active(sim_state_t* s, sim_param_t* params, int ncells)
+{
+    int hp = params->hugepages;
+    if (s->active.cells && ncells <= s->active.cap)
+        return;
+    if (s->active.cells && ncells < 2*s->active.cap)
+        ncells = 2*s->active.cap;
+    free(s->active.nbrs);
+    free(s->active.cells);
+    s->active.cap   = ncells;
+    s->active.cells = (int*) alloc_array(ncells * sizeof(int), hp);
+    s->active.nbrs  = (int*) alloc_array(9 * (size_t) ncells * sizeof(int),
+                                         hp);
+}
+
 void free_state(sim_state_t* s)
 {
-    free(s->a);
-    free(s->v);
-    free(s->vh);
+    free(s->res);
+    free(s->apy);
+    free(s->apx);
+    free(s->p);
+    free(s->nnb);
+    free(s->hs);
+    free(s->m);
+    free(s->ay);
+    free(s->ax);
+    free(s->vy);
+    free(s->vx);
+    free(s->vhy);
+    free(s->vhx);
+    free(s->y);
     free(s->x);
     free(s->rho);
-    free(s->ps);
-    free(s->bins);
+    free(s->bin_ids);
+    free(s->active.nbrs);
+    free(s->active.cells);
+    free(s->hash.slots);
+    free(s->bin_key);
+    free(s->bin_start);
+    free(s->arena.counts);
+    free(s->arena.cell);
     free(s);
 }
 
+/*@T
+ *
+ * The [[clone_state]] routine copies the particles of [[s0]] into a
+ * fresh state laid out for [[params]], which may call for a different
+ * cell size than the original.  The copy has no bins; the caller
+ * rebuilds them with [[build_bins]].
+ *@c*/
+sim_state_t* clone_state(const sim_state_t* s0, sim_param_t* params)
+{
+    int n = s0->n;
+    size_t nb = n * sizeof(float);
+    sim_state_t* s = alloc_state(s0->nmax, params);
+    s->n = n;
+    s->mass = s0->mass;
+    memcpy(s->rho, s0->rho, nb);
+    memcpy(s->x,   s0->x,   nb);
+    memcpy(s->y,   s0->y,   nb);
+    memcpy(s->vhx, s0->vhx, nb);
+    memcpy(s->vhy, s0->vhy, nb);
+    memcpy(s->vx,  s0->vx,  nb);
+    memcpy(s->vy,  s0->vy,  nb);
+    memcpy(s->ax,  s0->ax,  nb);
+    memcpy(s->ay,  s0->ay,  nb);
+    if (s0->m && s->m) {
+        memcpy(s->m,  s0->m,  nb);
+        memcpy(s->hs, s0->hs, nb);
+    }
+    if (s0->p && s->p)
+        memcpy(s->p, s0->p, nb);
+    return s;
+}
+
+/*@T
+ *
+ * First touch only helps if a thread stays on the core (and socket)
+ * where it touched its pages.  The [[bind_threads]] routine pins
+ * OpenMP thread $t$ to the $t$-th CPU the process is allowed to run
+ * on, so threads fill one socket before moving on to the next (on the
+ * usual numbering).  It should be called before the state is
+ * allocated.
+ *@c*/
+int bind_threads(void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+    int ncpu = CPU_COUNT(&allowed);
+    int status = 0;
+#pragma omp parallel reduction(|:status)
+    {
+        int t = omp_get_thread_num() % ncpu;
+        int cpu = 0;
+        for (int k = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed) && k++ == t)
+                break;
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+        status |= sched_setaffinity(0, sizeof(mine), &mine);
+    }
+    if (status != 0)
+        fprintf(stderr, "Could not bind threads to cores\n");
+    return status;
+}
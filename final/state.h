@@ -1,38 +1,157 @@
 #ifndef STATE_H
 #define STATE_H
 
-#include "particle.h"
+#include "params.h"
 /*@T
  * \section{System state}
  * 
  * The [[sim_state_t]] structure holds the information for the current
- * state of the system and of the integration algorithm.  The array
- * [[x]] has length $2n$, with [[ x[2*i+0] ]] and [[ x[2*i+1] ]] representing
- * the $x$ and $y$ coordinates of the particle positions.  The layout
- * for [[v]], [[vh]], and [[a]] is similar, while [[rho]] only has one
- * entry per particle.
+ * state of the system and of the integration algorithm.  Vector
+ * quantities are stored by component (structure of arrays): the
+ * particle positions are [[x[i]]] and [[y[i]]], and the layout for the
+ * full-step velocities [[vx]]/[[vy]], half-step velocities
+ * [[vhx]]/[[vhy]] and accelerations [[ax]]/[[ay]] is similar.  Each
+ * array starts on a 64-byte boundary and is padded to a multiple of
+ * [[STATE_PAD]] entries, so loops over particles make unit-stride,
+ * aligned loads and can run whole vectors past [[n]] without touching
+ * another array.
+ * 
+ * The bins are kept in compressed sparse row form: [[bin_ids]] lists
+ * the particle numbers in cell order, and cell $b$ is the stretch
+ * from [[bin_start[b]]] up to [[bin_start[b+1]]].  Rebinning needs the
+ * current cell of each particle and some per-thread count space, so
+ * the state owns a [[particle_arena_t]] with everything preallocated.
+ * A time step does no heap allocation at all.  On the sparse grid,
+ * only occupied cells have bins: [[bin_key]] names the grid cell of
+ * each bin, [[hash]] finds the bin of a grid cell, and the bin arrays
+ * grow (but never shrink) as more cells fill up.
+ * 
+ * Most cells of the box are usually empty, so rebinning also lists
+ * the occupied bins in [[active]], each with its $3 \times 3$ block of
+ * neighbor bins (empty ones marked $-1$), and the kernels sweep that
+ * list instead of the whole grid.
+ * 
+ * With adaptive resolution, each particle also carries its own mass
+ * [[m[i]]] and smoothing length [[hs[i]]], and [[n]] changes as
+ * particles are split and merged.  Merging conserves the number of
+ * unmerged particles a particle stands for, so the count never
+ * exceeds the initial [[nmax]] that the arrays are sized for.  Without
+ * adaptive resolution, [[m]] and [[hs]] are [[NULL]] and every particle
+ * has mass [[mass]] and size [[params->h]].  Likewise, [[nnb]] holds
+ * the neighbor count from the last density pass only when that output
+ * channel is selected, and the implicit pressure solver keeps the
+ * pressures [[p]] from step to step and needs room for the pressure
+ * accelerations [[apx]]/[[apy]] and the scaled density errors [[res]].
+ * 
+ * The density pass also adds up the index distance $|i-j|$ over
+ * neighbor pairs that share a cell in [[spread]], and counts those
+ * pairs in [[pairs]].  The particle arrays are indexed by particle
+ * number, so the average distance says how far apart in memory the
+ * data for particles in the same cell has drifted since they were last
+ * numbered in cell order; the step engine uses it to decide when to
+ * renumber.
  * 
  * The [[alloc_state]] and [[free_state]] functions take care of storage
- * for the local simulation state.
+ * for the local simulation state, [[clone_state]] copies the particles
+ * into a new state, and [[bind_threads]] pins the OpenMP
+ * threads to cores so that the storage stays local to them.
+ *
+ * \subsection{Memory budget}
+ *
+ * Memory, not time, decides the largest run that fits on a node, so
+ * the state keeps nothing per particle that it does not need.  The
+ * bytes per particle are
+ * \begin{center}
+ * \begin{tabular}{lr}
+ *   [[x]], [[y]], [[vhx]], [[vhy]], [[vx]], [[vy]], [[ax]], [[ay]] & 32 \\
+ *   [[rho]] & 4 \\
+ *   [[bin_ids]], [[arena.cell]] & 8 \\ \hline
+ *   total & 44 \\
+ *   adaptive resolution: [[m]], [[hs]] & +8 \\
+ *   neighbors channel: [[nnb]] & +4 \\
+ *   implicit pressure: [[p]], [[apx]], [[apy]], [[res]] & +16
+ * \end{tabular}
+ * \end{center}
+ * plus $4(p+2)$ bytes per cell for $p$ threads, and the output
+ * buffers in [[main]].  On the sparse grid, only occupied cells count,
+ * at $4(p+3)$ bytes each plus up to 32 bytes in the hash table.
+ * Either way, [[active]] takes 40 bytes per occupied cell.  The
+ * full-step velocities cannot be derived from [[vh]] and [[a]] on
+ * demand: the force pass reads the velocity of every neighbor while it
+ * overwrites the accelerations, so it needs both arrays at once either
+ * way.
+ *
+ * Particle numbers are [[int]], which allows a little over two
+ * billion particles; products that can get larger than that (byte
+ * counts, offsets into the per-thread count table) are computed in
+ * [[size_t]].
  *@c*/
+#define STATE_PAD 16      /* Floats per 64-byte line */
+
+typedef struct particle_arena_t {
+    int*  cell;           /* Current cell of each particle     */
+    int*  counts;         /* Cell counts, bin_size per thread
+                             plus one, then thread sums        */
+    int   nthreads;       /* Threads [[counts]] is sized for   */
+    int   moved[2];       /* Particles that changed cells      */
+    int   epoch;          /* Which [[moved]] counter is live   */
+} particle_arena_t;
+
+typedef struct cell_hash_t {
+    int*  slots;          /* (cell, bin) pairs; cell -1 is free */
+    int   cap;            /* Slots, a power of two             */
+} cell_hash_t;
+
+typedef struct cell_list_t {
+    int*  cells;          /* Occupied bins, in bin order        */
+    int*  nbrs;           /* Nine neighbor bins per entry       */
+    int   n;              /* Entries in use                     */
+    int   cap;            /* Entries there is room for          */
+} cell_list_t;
+
 typedef struct sim_state_t {
     int n;                /* Number of particles    */
+    int nmax;             /* Capacity of the arrays */
     float mass;           /* Particle mass          */
     int MAX;
     int bin_size;
-    particle_t* restrict ps;
-    bin_t* restrict bins;
+    int* restrict bin_start;  /* Start of each cell in [[bin_ids]] */
+    int* restrict bin_ids;    /* Particle numbers in cell order    */
+    int* restrict bin_key;    /* Grid cell of each bin (sparse only) */
+    int bin_cap;              /* Bins the bin arrays have room for */
+    cell_hash_t hash;         /* Grid cell to bin (sparse only)    */
+    cell_list_t active;       /* Occupied bins, kept by rebinning  */
+    particle_arena_t arena;
     float* restrict rho;  /* Densities              */
     float* restrict x;    /* Positions              */
-    float* restrict vh;   /* Velocities (half step) */
-    float* restrict v;    /* Velocities (full step) */
-    float* restrict a;    /* Acceleration           */
-
+    float* restrict y;
+    float* restrict vhx;  /* Velocities (half step) */
+    float* restrict vhy;
+    float* restrict vx;   /* Velocities (full step) */
+    float* restrict vy;
+    float* restrict ax;   /* Acceleration           */
+    float* restrict ay;
+    float* restrict m;    /* Per-particle mass (adaptive only) */
+    float* restrict hs;   /* Per-particle size (adaptive only) */
+    int*   restrict nnb;  /* Neighbor counts (neighbors channel only) */
+    float* restrict p;    /* Pressure (implicit solver only)   */
+    float* restrict apx;  /* Pressure acceleration (implicit only) */
+    float* restrict apy;
+    float* restrict res;  /* Density error over $A_i$ (implicit only) */
+    float  perr;          /* Largest compression, last sweep   */
+    long long iters;      /* Pressure sweeps so far            */
+    long long spread;     /* Sum of |i-j| over neighbor pairs */
+    long long pairs;      /* Pairs counted in [[spread]]      */
 } sim_state_t;
 
 
-sim_state_t* alloc_state(int n, float h);
+sim_state_t* alloc_state(int n, sim_param_t* params);
 void free_state(sim_state_t* s);
+sim_state_t* clone_state(const sim_state_t* s0, sim_param_t* params);
+int bind_threads(void);
+void reserve_bins(sim_state_t* s, sim_param_t* params, int nbins);
+void reserve_hash(sim_state_t* s, sim_param_t* params, int cap);
+void reserve_active(sim_state_t* s, sim_param_t* params, int ncells);
 
 /*@q*/
 #endif /* STATE_H */
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <omp.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "leapfrog.h"
+#include "buckets.h"
+#include "adapt.h"
+#include "taskgraph.h"
+#include "perfctr.h"
+#include "step.h"
+
+/*@T
+ * \subsection{One parallel region per run}
+ *
+ * Forking a team for each of the two kernel sweeps, and running the
+ * integration and rebinning on one thread in between, costs more than
+ * the work itself for small problems.  So the whole time loop runs
+ * inside a single parallel region.  Every thread walks the loop; the
+ * phases are the [[_ws]] versions, which use only orphaned worksharing
+ * and end in a barrier where the next phase needs one.  Renumbering
+ * (see below) and the merging and splitting of adaptive resolution
+ * (once a frame) are serial and run as [[single]] sections; the bins
+ * that adaptive resolution invalidates are then sorted again by the
+ * whole team.  The frame callback runs on the master thread only,
+ * followed by a barrier so that nobody moves particles while they are
+ * written out.  The master counts the particles it steps when the
+ * step starts, since [[s->n]] can change once rebinning is past its
+ * first barrier.
+ *
+ * For debugging convenience, we use [[check_state]] after every
+ * step, just so that we don't spend a lot of time on a simulation
+ * that has gone berserk.  It is also orphaned, and doesn't wait.
+ *@c*/
+void check_state(sim_state_t* s)
+{
+    const int n = s->n;
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; ++i) {
+        float xi = s->x[i];
+        float yi = s->y[i];
+        assert( xi >= 0 && xi <= 1 );
+        assert( yi >= 0 && yi <= 1 );
+    }
+}
+
+/*@T
+ * \subsection{Reproducibility}
+ *
+ * The output does not depend on the number of threads or on how the
+ * work is scheduled among them.  Each particle's density and
+ * acceleration are summed by the one pass over its own cell, in the
+ * order its neighbors appear in the bin lists, and nothing else ever
+ * adds into them; there are no floating point atomics or reductions.
+ * The bin lists do not depend on the threads either: the counting
+ * sort in [[update_bins]] lists each cell in increasing particle
+ * order for any partition.  Renumbering and
+ * adaptive resolution are serial, and task tiles only change which
+ * thread runs a cell.  What can change the results is a decision
+ * based on timings: when to renumber, and the cell width and
+ * renumbering interval chosen by the auto-tuner.  Deterministic mode
+ * ([[-D]]) makes those decisions from the simulation state alone, so
+ * the output file is byte for byte the same for any
+ * [[OMP_NUM_THREADS]]; [[make repro]] checks this for a few
+ * configurations.
+ *@c*/
+
+/*@T
+ * \subsection{When to renumber}
+ *
+ * Renumbering the particles in cell order ([[optimize_bins]]) takes
+ * time, and what it buys back depends on how fast the fluid mixes and
+ * on how much of the state fits in cache, so a fixed schedule either
+ * renumbers too often or lets locality decay for too long.  Unless
+ * [[params->reorder]] fixes the interval, we decide after every step
+ * from the average index distance $D$ between neighbors in the same
+ * cell that the density pass measures (see [[state.h]]); right after
+ * a renumbering it is about a third of the cell population.  The cost
+ * model is that a step takes $\kappa (D - D_0)$ seconds longer than it
+ * did right after the last renumbering, when the distance was $D_0$;
+ * we renumber once the predicted loss since then exceeds the measured
+ * cost of the last renumbering.
+ *
+ * The slope $\kappa$ comes from the timing layer.  Step times are
+ * noisy, so they are averaged over [[REORDER_WINDOW]] steps, and a
+ * slope is only measured across a real loss of locality: until the
+ * first calibration, we renumber when $D$ has grown by
+ * [[REORDER_GROWTH]], and at that point (and at any later renumbering
+ * where $D$ has grown as much) the step time just before, less the
+ * step time just after the previous renumbering, divided by the
+ * growth in $D$, updates $\kappa$.  When locality does not matter,
+ * for instance because everything fits in cache, $\kappa$ comes out
+ * near zero and we renumber only every [[REORDER_MAX_FRAMES]] frames,
+ * to recalibrate.
+ *
+ * Step times differ from run to run, and renumbering changes the order
+ * in which each particle adds up its neighbors, so in deterministic
+ * mode ([[-D]]) the timings are ignored and we renumber whenever $D$
+ * has grown by [[REORDER_GROWTH]].  The distance sums are integers,
+ * so they come out the same whatever the thread count.
+ *@c*/
+#define REORDER_WINDOW     16
+#define REORDER_GROWTH     0.25
+#define REORDER_MAX_FRAMES 16
+
+typedef struct reorder_model_t {
+    int    calibrated;
+    int    since;       /* Steps since the last renumbering        */
+    double kappa;       /* Seconds per step per unit of distance   */
+    double cost;        /* Seconds taken by the last renumbering   */
+    double spread0;     /* Distance right after it                 */
+    double t0;          /* Step time right after it                */
+    double t;           /* Running average of the step time        */
+    double loss;        /* Predicted seconds lost since then       */
+} reorder_model_t;
+
+static double take_spread(sim_state_t* s)
+{
+    double spread = s->pairs ? (double) s->spread / s->pairs : 0;
+    s->spread = 0;
+    s->pairs  = 0;
+    return spread;
+}
+
+static int reorder_due(reorder_model_t* m, sim_state_t* s, double tstep,
+                       sim_param_t* params)
+{
+    const int npframe = params->npframe;
+    double spread = take_spread(s);
+    int k = ++m->since;
+    m->t = (k == 1) ? tstep : m->t + (tstep - m->t) / REORDER_WINDOW;
+    if (k == 1)
+        m->spread0 = spread;
+    if (k == REORDER_WINDOW)
+        m->t0 = m->t;
+    if (k > REORDER_WINDOW && spread > m->spread0)
+        m->loss += m->kappa * (spread - m->spread0);
+
+    int grown = (k > 2*REORDER_WINDOW &&
+                 spread >= (1 + REORDER_GROWTH) * m->spread0);
+    int due = (m->calibrated && !params->deterministic) ?
+        (m->loss >= m->cost) : grown;
+    if (k >= REORDER_MAX_FRAMES * npframe)
+        due = 1;
+    if (due && grown) {
+        double kappa = (m->t - m->t0) / (spread - m->spread0);
+        if (kappa < 0)
+            kappa = 0;
+        m->kappa = m->calibrated ? (m->kappa + kappa) / 2 : kappa;
+        m->calibrated = 1;
+    }
+    return due;
+}
+
+static void reorder_done(reorder_model_t* m, double cost)
+{
+    m->cost  = cost;
+    m->since = 0;
+    m->loss  = 0;
+}
+
+double run_steps(sim_state_t* s, sim_param_t* params, int nsteps,
+                 frame_fun_t frame, void* data)
+{
+    const double dt = params->dt;
+    const int npframe = params->npframe;
+    const int reorder = params->reorder;
+    double particle_steps = 0;
+    reorder_model_t model = {0};
+    double tstart = 0;
+    int due = 0, adapted = 0;
+    take_spread(s);
+
+#pragma omp parallel shared(particle_steps, model, tstart, due, adapted)
+    {
+        for (int i = 1; i <= nsteps; ++i) {
+#pragma omp master
+            {
+                tstart = omp_get_wtime();
+                particle_steps += s->n;
+            }
+            if (params->tile) {
+                taskgraph_step_ws(s, params, dt);
+            } else {
+                compute_accel_ws(s, params);
+                perf_begin(PHASE_INTEGRATE);
+                leapfrog_step(s, params, dt);
+                perf_end(PHASE_INTEGRATE);
+#pragma omp barrier
+            }
+            perf_begin(PHASE_INTEGRATE);
+            check_state(s);
+            perf_end(PHASE_INTEGRATE);
+            update_bins_ws(s, params);
+
+            int renumber;
+            if (reorder > 0) {
+                renumber = (i % reorder == 0);
+            } else {
+#pragma omp single
+                due = reorder_due(&model, s, omp_get_wtime() - tstart,
+                                  params);
+                renumber = due;
+            }
+            int at_frame = (i % npframe == 0);
+            if (!at_frame && !renumber)
+                continue;
+            if (at_frame && params->adaptive) {
+                perf_begin(PHASE_REBIN);
+#pragma omp single nowait
+                adapted = adapt_particles(s, params);
+                perf_end(PHASE_REBIN);
+#pragma omp barrier
+                if (adapted)
+                    update_bins_ws(s, params);
+            }
+            if (renumber) {
+                perf_begin(PHASE_REBIN);
+#pragma omp single nowait
+                {
+                    double t = omp_get_wtime();
+                    optimize_bins(s, params, 0);
+                    reorder_done(&model, omp_get_wtime() - t);
+                    take_spread(s);
+                }
+                perf_end(PHASE_REBIN);
+#pragma omp barrier
+            }
+            if (at_frame && frame) {
+#pragma omp master
+                {
+                    perf_begin(PHASE_OUTPUT);
+                    frame(s, params, data);
+                    perf_end(PHASE_OUTPUT);
+                }
+#pragma omp barrier
+            }
+        }
+    }
+    return particle_steps;
+}
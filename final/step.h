@@ -0,0 +1,28 @@
+#ifndef STEP_H
+#define STEP_H
+
+#include <stdio.h>
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{The step engine}
+ *
+ * The [[run_steps]] routine advances the state by [[nsteps]] leapfrog
+ * steps (after [[leapfrog_start]] has been called), renumbers the
+ * particles in cell order every [[params->reorder]] steps (or when
+ * locality has decayed enough to pay for it, if that is zero) and, if
+ * [[frame]] is not [[NULL]], calls it on the master thread every
+ * [[params->npframe]] steps.  It returns
+ * the number of particle-steps taken, which changes from frame to
+ * frame under adaptive resolution.  The [[check_state]] routine
+ * asserts that every particle is still inside the unit box.
+ *@c*/
+typedef void (*frame_fun_t)(sim_state_t* s, sim_param_t* params, void* data);
+
+double run_steps(sim_state_t* s, sim_param_t* params, int nsteps,
+                 frame_fun_t frame, void* data);
+void check_state(sim_state_t* s);
+
+/*@q*/
+#endif /* STEP_H */
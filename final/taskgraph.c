@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "buckets.h"
+#include "leapfrog.h"
+#include "perfctr.h"
+#include "taskgraph.h"
+
+/*@T
+ * \subsection{Tile dependencies}
+ *
+ * A tile is at least one cell wide, so everything a cell's particles
+ * interact with lies in the $3 \times 3$ block of tiles around it.
+ * That gives three tasks per tile and a short list of dependencies:
+ * \begin{itemize}
+ * \item the density task of a tile needs only the positions at the
+ *   start of the step;
+ * \item the force task of a tile needs the densities of its $3 \times 3$
+ *   block of tiles;
+ * \item the integration task of a tile moves its particles, which the
+ *   density and force tasks of the neighboring tiles read, so it waits
+ *   for the force tasks of the $3 \times 3$ block (which in turn waited
+ *   for their densities).
+ * \end{itemize}
+ * Each dependency is expressed through a one-byte token per tile and
+ * phase; the tokens are never read or written, so they borrow the
+ * rebinning counts in the arena, which have room for at least two
+ * bytes per cell.  Tiles off a wall are replaced by the tile itself, which
+ * just repeats a dependency; in a periodic direction the block wraps
+ * around like the cell stencil does.  There are no barriers between
+ * phases, so a crowded tile holds up only its neighbors.
+ *
+ * Hardware counters cannot be split by phase when phases interleave,
+ * so the whole graph is counted as [[PHASE_FORCE]].
+ *@c*/
+static void tile_neighbors(sim_param_t* params, int nt, int t, int* nb)
+{
+    const int px = params->periodic & PERIODIC_X;
+    const int py = params->periodic & PERIODIC_Y;
+    const int tx = t % nt;
+    const int ty = t / nt;
+    int k = 0;
+    for (int dy = -1; dy <= 1; ++dy) {
+        int jy = ty + dy;
+        if (py) jy = (jy + nt) % nt;
+        for (int dx = -1; dx <= 1; ++dx) {
+            int jx = tx + dx;
+            if (px) jx = (jx + nt) % nt;
+            nb[k++] = (jx < 0 || jx >= nt || jy < 0 || jy >= nt) ?
+                t : jx + jy*nt;
+        }
+    }
+}
+
+typedef void (*cell_fun_t)(sim_state_t*, sim_param_t*, int, const int*);
+
+static void tile_cells(sim_state_t* s, sim_param_t* params, int T, int nt,
+                       int t, cell_fun_t f)
+{
+    const int MAX = s->MAX;
+    const int x0  = (t % nt) * T, x1 = x0+T < MAX ? x0+T : MAX;
+    const int y0  = (t / nt) * T, y1 = y0+T < MAX ? y0+T : MAX;
+    int nns[9];
+    for (int iy = y0; iy < y1; ++iy)
+        for (int ix = x0; ix < x1; ++ix) {
+            int b = ix + iy*MAX;
+            if (s->bin_start[b+1] == s->bin_start[b])
+                continue;
+            neighbors3(s, params, b, nns);
+            f(s, params, b, nns);
+        }
+}
+
+static void tile_integrate(sim_state_t* s, sim_param_t* params, double dt,
+                           int T, int nt, int t)
+{
+    const int MAX = s->MAX;
+    const int x0  = (t % nt) * T, x1 = x0+T < MAX ? x0+T : MAX;
+    const int y0  = (t / nt) * T, y1 = y0+T < MAX ? y0+T : MAX;
+    for (int iy = y0; iy < y1; ++iy)
+        for (int ix = x0; ix < x1; ++ix) {
+            int b = ix + iy*MAX;
+            for (int k = s->bin_start[b]; k < s->bin_start[b+1]; ++k)
+                leapfrog_step_one(s, params, dt, s->bin_ids[k]);
+        }
+}
+
+void taskgraph_step_ws(sim_state_t* s, sim_param_t* params, double dt)
+{
+    const int T  = params->tile > 0 ? params->tile : 1;
+    const int nt = (s->MAX + T-1) / T;
+    const int ntiles = nt*nt;
+    cell_fun_t density = s->m ? density_cell_adaptive : density_cell;
+    cell_fun_t accel   = s->m ? accel_cell_adaptive   : accel_cell;
+    // Only named in depend clauses, which gcc does not count as a use
+    char* dtok = (char*) s->arena.counts;
+    char* ftok __attribute__((unused)) = dtok + ntiles;
+
+    perf_begin(PHASE_FORCE);
+#pragma omp single
+    {
+        for (int t = 0; t < ntiles; ++t) {
+#pragma omp task depend(out: dtok[t])
+            tile_cells(s, params, T, nt, t, density);
+        }
+        for (int t = 0; t < ntiles; ++t) {
+            int nb[9];
+            tile_neighbors(params, nt, t, nb);
+#pragma omp task depend(in: dtok[nb[0]], dtok[nb[1]], dtok[nb[2]], \
+                            dtok[nb[3]], dtok[nb[4]], dtok[nb[5]], \
+                            dtok[nb[6]], dtok[nb[7]], dtok[nb[8]]) \
+                 depend(out: ftok[t])
+            tile_cells(s, params, T, nt, t, accel);
+        }
+        for (int t = 0; t < ntiles; ++t) {
+            int nb[9];
+            tile_neighbors(params, nt, t, nb);
+#pragma omp task depend(in: ftok[nb[0]], ftok[nb[1]], ftok[nb[2]], \
+                            ftok[nb[3]], ftok[nb[4]], ftok[nb[5]], \
+                            ftok[nb[6]], ftok[nb[7]], ftok[nb[8]])
+            tile_integrate(s, params, dt, T, nt, t);
+        }
+    }
+    perf_end(PHASE_FORCE);
+}
+
+void taskgraph_step(sim_state_t* s, sim_param_t* params, double dt)
+{
+#pragma omp parallel
+    taskgraph_step_ws(s, params, dt);
+}
@@ -0,0 +1,22 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{Task graph time steps}
+ *
+ * The [[taskgraph_step]] routine does the work of [[compute_accel]]
+ * followed by [[leapfrog_step]], with the grid cut into square tiles
+ * of [[params->tile]] cells on a side and each phase of each tile run
+ * as an OpenMP task.  The results are the same as the phase-by-phase
+ * version.  As with the kernels, [[taskgraph_step_ws]] is the version
+ * for the threads of an enclosing parallel region; it returns once
+ * every task has finished.
+ *@c*/
+void taskgraph_step(sim_state_t* s, sim_param_t* params, double dt);
+void taskgraph_step_ws(sim_state_t* s, sim_param_t* params, double dt);
+
+/*@q*/
+#endif /* TASKGRAPH_H */
@@ -1,15 +1,22 @@
 #include "timing.h"
+#include "phase.h"
 #include <time.h>
+#include <sys/time.h>
+
+/* Labels for the phases in phase.h, shared by the instrumentation. */
+const char* phase_names[NPHASES] = {
+    "density", "force", "pressure", "integrate", "rebin", "output"
+};
+
 
 /* If the clock macro is defined, we use the POSIX clock_gettime,
  * and CLOCK defines which timer should be used.  Otherwise, we use
  * the system clock() command.
  */
 
-
 #ifdef CLOCK
 static struct timespec watches[NWATCHES];
-#elseif GTD
+#elif defined(GTD)
 static struct timeval watches[NWATCHES];
 #else
 static clock_t watches[NWATCHES];
@@ -20,7 +27,7 @@ void tic(int watch)
 {
 #ifdef CLOCK
     clock_gettime(CLOCK, watches+watch);
-#elseif GTD
+#elif defined(GTD)
     gettimeofday(watches+watch, NULL);
 #else
     watches[watch] = clock();
@@ -37,12 +44,12 @@ double toc(int watch)
     elapsed = now.tv_nsec - (double) watches[watch].tv_nsec;
     elapsed *= 1.0E-9;
     elapsed += now.tv_sec - (double) watches[watch].tv_sec;
-#elseif GTD
+#elif defined(GTD)
     struct timeval now;
     gettimeofday(&now, NULL);
-    elapsed = now.tv_usec = (double) watches[watch].tv_sec;
+    elapsed = now.tv_usec - (double) watches[watch].tv_usec;
     elapsed *= 1.0e-6;
-    elapsed += now.tv_sec = (double) watches[watch].tv_sec;
+    elapsed += now.tv_sec - (double) watches[watch].tv_sec;
 #else
     clock_t now = clock();
     elapsed = (double) (now-watches[watch])/CLOCKS_PER_SEC;
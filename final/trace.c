@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "trace.h"
+
+/*@T
+ * \subsection{Recording}
+ *
+ * Each thread writes only its own ring, so recording takes no locks
+ * and no atomics: [[trace_begin]] notes the time, and [[trace_end]]
+ * stores the event and adds its length to the thread's busy time for
+ * the phase.  When a ring fills up, the oldest events are overwritten,
+ * so a long run keeps its last [[nevents]] phases per thread; the busy
+ * times still cover the whole run.  The rings are allocated and first
+ * written by their own threads, so they sit in local memory.  With
+ * [[nevents]] zero there are no rings, and only the busy times are
+ * kept, which is all the metrics exporter needs.
+ *
+ * Times come from [[omp_get_wtime]] and are stored relative to
+ * [[trace_init]].  A thread's share of a phase runs from its
+ * [[perf_begin]] to its [[perf_end]].  Every phase ends before the
+ * barrier that follows it, and barriers inside a phase go through
+ * [[perf_barrier]], which records the work on either side as separate
+ * events, so the busy time is the time the thread spent working.  The
+ * task graph step is the exception: its tasks run while the threads
+ * wait at the end of the graph, so there the wait is counted.
+ *@c*/
+typedef struct trace_event_t {
+    double t0, t1;
+    int    phase;
+} trace_event_t;
+
+/* Per-thread ring, padded to keep threads off each other's lines */
+typedef struct trace_thread_t {
+    trace_event_t* ring;
+    long long count;             /* Events recorded, including lost */
+    double start[NPHASES];
+    double busy[NPHASES];
+} __attribute__((aligned(64))) trace_thread_t;
+
+static trace_thread_t* threads;
+static int    nthreads;
+static int    capacity;
+static int    enabled;
+static double origin;
+
+int trace_init(int nevents)
+{
+    nthreads = omp_get_max_threads();
+    capacity = nevents;
+    if (posix_memalign((void**) &threads, 64,
+                       nthreads * sizeof(trace_thread_t)) != 0)
+        return -1;
+    memset(threads, 0, nthreads * sizeof(trace_thread_t));
+
+    int nfail = 0;
+#pragma omp parallel reduction(+:nfail)
+    {
+        int t = omp_get_thread_num();
+        if (t < nthreads && capacity > 0) {
+            size_t nbytes = capacity * sizeof(trace_event_t);
+            trace_event_t* ring = (trace_event_t*) malloc(nbytes);
+            if (ring)
+                memset(ring, 0, nbytes);
+            threads[t].ring = ring;
+            nfail += (ring == NULL);
+        }
+    }
+    if (nfail) {
+        fprintf(stderr, "Could not allocate trace buffers; tracing disabled\n");
+        trace_finalize();
+        return -1;
+    }
+    origin  = omp_get_wtime();
+    enabled = 1;
+    return 0;
+}
+
+void trace_finalize(void)
+{
+    if (threads == NULL)
+        return;
+    for (int t = 0; t < nthreads; ++t)
+        free(threads[t].ring);
+    free(threads);
+    threads = NULL;
+    enabled = 0;
+}
+
+void trace_begin(int phase)
+{
+    if (!enabled)
+        return;
+    int t = omp_get_thread_num();
+    if (t >= nthreads)
+        return;
+    threads[t].start[phase] = omp_get_wtime() - origin;
+}
+
+void trace_end(int phase)
+{
+    if (!enabled)
+        return;
+    int t = omp_get_thread_num();
+    if (t >= nthreads)
+        return;
+    trace_thread_t* tt = &threads[t];
+    double t1 = omp_get_wtime() - origin;
+    tt->busy[phase] += t1 - tt->start[phase];
+    if (capacity == 0)
+        return;
+    trace_event_t* e = &tt->ring[tt->count++ % capacity];
+    e->t0    = tt->start[phase];
+    e->t1    = t1;
+    e->phase = phase;
+}
+
+double trace_busy(int phase)
+{
+    int t = omp_get_thread_num();
+    if (!enabled || t >= nthreads)
+        return 0;
+    return threads[t].busy[phase];
+}
+
+/*@T
+ * \subsection{Load imbalance}
+ *
+ * For each phase, the report gives the largest and the mean busy time
+ * over the threads, and their ratio.  A ratio of one means every
+ * thread did the same amount of work; the rest of the team spends the
+ * difference between the largest and the mean waiting at the next
+ * barrier.  Phases that only one thread runs (output, and the serial
+ * parts of rebinning) show a ratio near the number of threads, which
+ * is what they cost.
+ *@c*/
+void trace_report(FILE* fp)
+{
+    if (!enabled)
+        return;
+
+    fprintf(fp, "\nThread busy time per phase (%d threads)\n", nthreads);
+    fprintf(fp, "%-10s %11s %11s %10s\n", "phase", "max (s)", "mean (s)",
+            "imbalance");
+    for (int p = 0; p < NPHASES; ++p) {
+        double max = 0, sum = 0;
+        for (int t = 0; t < nthreads; ++t) {
+            double b = threads[t].busy[p];
+            sum += b;
+            if (b > max)
+                max = b;
+        }
+        if (max == 0)
+            continue;
+        double mean = sum / nthreads;
+        fprintf(fp, "%-10s %11.4g %11.4g %10.3f\n", phase_names[p],
+                max, mean, max / mean);
+    }
+
+    long long lost = 0;
+    for (int t = 0; t < nthreads; ++t)
+        if (threads[t].count > capacity)
+            lost += threads[t].count - capacity;
+    if (lost)
+        fprintf(fp, "(trace kept the last %d events per thread; "
+                "%lld older ones overwritten)\n", capacity, lost);
+}
+
+/*@T
+ * \subsection{Chrome trace output}
+ *
+ * Each event becomes a complete (``X'') event with its start and
+ * length in microseconds, one timeline per thread, and a metadata
+ * event names each timeline.  The events of each thread are written
+ * oldest first.
+ *@c*/
+int trace_write(const char* fname)
+{
+    if (!enabled)
+        return 0;
+    FILE* fp = fopen(fname, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open trace file %s\n", fname);
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char* sep = "\n";
+    for (int t = 0; t < nthreads; ++t) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", sep, t, t);
+        sep = ",\n";
+    }
+    for (int t = 0; t < nthreads; ++t) {
+        trace_thread_t* tt = &threads[t];
+        long long first = tt->count > capacity ? tt->count - capacity : 0;
+        for (long long k = first; k < tt->count; ++k) {
+            const trace_event_t* e = &tt->ring[k % capacity];
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"sph\",\"ph\":\"X\","
+                    "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    sep, phase_names[e->phase], t,
+                    e->t0 * 1e6, (e->t1 - e->t0) * 1e6);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 0;
+}
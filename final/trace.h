@@ -0,0 +1,31 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include "phase.h"
+
+/*@T
+ * \section{Timeline tracing}
+ *
+ * Totals per phase do not show which thread is late to a barrier, or
+ * when.  When enabled with [[-X]], [[trace_init]] gives every OpenMP
+ * thread a preallocated ring of [[nevents]] events, and every
+ * [[perf_begin]]/[[perf_end]] pair also records the wall clock times
+ * at which the thread started and finished its share of the phase.
+ * At the end of the run, [[trace_report]] prints how unevenly each
+ * phase was spread over the threads, and [[trace_write]] dumps the
+ * events in the Chrome trace event format, which [[chrome://tracing]]
+ * and Perfetto display as one timeline per thread.  When tracing is
+ * off, the recording calls return immediately.  The busy time the
+ * calling thread has spent in a phase so far is [[trace_busy]].
+ *@c*/
+int  trace_init(int nevents);
+void trace_begin(int phase);
+void trace_end(int phase);
+double trace_busy(int phase);
+void trace_report(FILE* fp);
+int  trace_write(const char* fname);
+void trace_finalize(void);
+
+/*@q*/
+#endif /* TRACE_H */
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "leapfrog.h"
+#include "buckets.h"
+#include "timing.h"
+#include "step.h"
+#include "tune.h"
+
+/*@T
+ * \subsection{Trials}
+ *
+ * A trial copies the state with the candidate cell size, takes the
+ * same start-up step as [[main]], runs a couple of untimed steps to
+ * warm the caches and wake the thread team, and then times blocks of
+ * [[nsteps]] steps with [[run_steps]] until at least
+ * [[TUNE_MIN_SECONDS]] have passed, so that small problems are not
+ * judged on a few hundred microseconds of timer noise.  The trials
+ * never touch the real state, so tuning does not change the
+ * trajectory.
+ *@c*/
+#define TUNE_WATCH        2
+#define TUNE_WARMUP       2
+#define TUNE_STEPS        20
+#define TUNE_MIN_SECONDS  0.1
+#define TUNE_MAX_BLOCKS   8
+
+typedef struct tune_t {
+    int   threads;
+    float cell;
+    int   reorder;
+} tune_t;
+
+static double trial(const sim_state_t* s0, sim_param_t* params,
+                    const tune_t* t, int nsteps)
+{
+    sim_param_t p = *params;
+    p.cell    = t->cell;
+    p.reorder = t->reorder;
+    omp_set_num_threads(t->threads);
+
+    sim_state_t* s = clone_state(s0, &p);
+    build_bins(s, &p);
+    compute_accel(s, &p);
+    leapfrog_start(s, &p, p.dt);
+    update_bins(s, &p);
+    optimize_bins(s, &p, 1);
+    run_steps(s, &p, TUNE_WARMUP, NULL, NULL);
+
+    double particle_steps = 0, seconds = 0;
+    for (int k = 0; k < TUNE_MAX_BLOCKS && seconds < TUNE_MIN_SECONDS; ++k) {
+        tic(TUNE_WATCH);
+        particle_steps += run_steps(s, &p, nsteps, NULL, NULL);
+        seconds += toc(TUNE_WATCH);
+    }
+    free_state(s);
+    return particle_steps / seconds;
+}
+
+static void try_config(const sim_state_t* s0, sim_param_t* params,
+                       const tune_t* t, int nsteps,
+                       tune_t* best, double* best_rate)
+{
+    double rate = trial(s0, params, t, nsteps);
+    if (rate > *best_rate) {
+        *best_rate = rate;
+        *best = *t;
+    }
+}
+
+/*@T
+ *
+ * \subsection{Search}
+ *
+ * Trying every combination would take too long, so the knobs are tuned
+ * one at a time, each starting from the best setting found so far:
+ * first the thread count (powers of two up to the available threads,
+ * since small problems often run fastest on a fraction of the
+ * machine), then the cell width, then the renumbering interval
+ * (against the default of zero, which leaves it to the locality model
+ * in [[run_steps]]).  Cells narrower than $2h$ hold fewer particles
+ * that are out of range, but adaptive runs need the full $2h$ for
+ * their merged particles, so the cell width is only tuned without
+ * [[-R]].  Both the cell width and the renumbering interval change the
+ * order of the floating point sums, so in deterministic mode only the
+ * thread count is tuned, and cached values for the other two are
+ * ignored.  Renumbering pays off over
+ * many steps, so those trials run for a whole frame's worth of steps
+ * and start by re-timing the best setting over the same length.
+ *@c*/
+static const float cell_widths[] = { 2, 1.5, 1 };
+static const int reorder_divs[] = { 1, 2, 4, 10 };
+#define NCELLS   ((int) (sizeof(cell_widths)/sizeof(cell_widths[0])))
+#define NREORDER ((int) (sizeof(reorder_divs)/sizeof(reorder_divs[0])))
+
+static double search(const sim_state_t* s, sim_param_t* params,
+                     tune_t* best)
+{
+    int maxthreads = omp_get_max_threads();
+    int npframe = params->npframe;
+    best->threads = maxthreads;
+    best->cell    = params->cell;
+    best->reorder = params->reorder;
+    double rate = trial(s, params, best, TUNE_STEPS);
+
+    tune_t t = *best;
+    for (int k = 1; k < maxthreads; k *= 2) {
+        t.threads = k;
+        try_config(s, params, &t, TUNE_STEPS, best, &rate);
+    }
+
+    if (params->deterministic)
+        return rate;
+
+    t = *best;
+    for (int k = 0; k < NCELLS && !params->adaptive; ++k) {
+        t.cell = cell_widths[k];
+        if (t.cell != best->cell)
+            try_config(s, params, &t, TUNE_STEPS, best, &rate);
+    }
+
+    rate = trial(s, params, best, npframe);
+    t = *best;
+    for (int k = 0; k < NREORDER; ++k) {
+        t.reorder = npframe / reorder_divs[k];
+        if (t.reorder >= 1 && t.reorder != best->reorder)
+            try_config(s, params, &t, npframe, best, &rate);
+    }
+    return rate;
+}
+
+/*@T
+ *
+ * \subsection{The tuning cache}
+ *
+ * The cache is a text file with one result per line: the host name,
+ * the available threads, the particle count, and the settings that
+ * change what is fast (adaptive resolution, task tiles, the sparse
+ * grid, the periodic directions and the implicit solver tolerance),
+ * followed by the chosen
+ * thread count, cell width and renumbering interval and the rate they
+ * achieved.  New results are appended, and the last matching line
+ * wins, so the file can be edited or truncated by hand.
+ *@c*/
+typedef struct tune_key_t {
+    char host[64];
+    int  maxthreads;
+    int  n;
+    int  adaptive;
+    int  tile;
+    int  sparse;
+    int  periodic;
+    float implicit;
+} tune_key_t;
+
+static void make_key(tune_key_t* key, const sim_state_t* s,
+                     const sim_param_t* params)
+{
+    memset(key, 0, sizeof(*key));
+    if (gethostname(key->host, sizeof(key->host)-1) != 0)
+        strcpy(key->host, "unknown");
+    key->maxthreads = omp_get_max_threads();
+    key->n          = s->n;
+    key->adaptive   = params->adaptive;
+    key->tile       = params->tile;
+    key->sparse     = params->sparse;
+    key->periodic   = params->periodic;
+    key->implicit   = params->implicit;
+}
+
+static int read_cache(const char* fname, const tune_key_t* key,
+                      tune_t* t, double* rate)
+{
+    FILE* fp = fopen(fname, "r");
+    if (fp == NULL)
+        return 0;
+    int found = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        tune_key_t k;
+        tune_t     v;
+        double     r;
+        memset(&k, 0, sizeof(k));
+        if (sscanf(line, "%63s %d %d %d %d %d %d %g %d %g %d %lg", k.host,
+                   &k.maxthreads, &k.n, &k.adaptive, &k.tile, &k.sparse,
+                   &k.periodic, &k.implicit,
+                   &v.threads, &v.cell, &v.reorder, &r) != 12)
+            continue;
+        if (strcmp(k.host, key->host) == 0 &&
+            k.maxthreads == key->maxthreads && k.n == key->n &&
+            k.adaptive == key->adaptive && k.tile == key->tile &&
+            k.sparse == key->sparse && k.periodic == key->periodic &&
+            k.implicit == key->implicit &&
+            v.threads >= 1 && v.threads <= key->maxthreads &&
+            v.cell >= 1 && v.reorder >= 0) {
+            *t = v;
+            *rate = r;
+            found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void write_cache(const char* fname, const tune_key_t* key,
+                        const tune_t* t, double rate)
+{
+    FILE* fp = fopen(fname, "a");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open tuning cache %s\n", fname);
+        return;
+    }
+    fprintf(fp, "%s %d %d %d %d %d %d %.9g %d %g %d %g\n", key->host,
+            key->maxthreads, key->n, key->adaptive, key->tile, key->sparse,
+            key->periodic, key->implicit,
+            t->threads, t->cell, t->reorder, rate);
+    fclose(fp);
+}
+
+sim_state_t* autotune(sim_state_t* s, sim_param_t* params)
+{
+    tune_key_t key;
+    tune_t best;
+    double rate;
+    make_key(&key, s, params);
+    int cached = read_cache(params->tune, &key, &best, &rate);
+    if (!cached) {
+        rate = search(s, params, &best);
+        write_cache(params->tune, &key, &best, rate);
+    }
+    if (params->deterministic) {
+        best.cell    = params->cell;
+        best.reorder = params->reorder;
+    }
+    fprintf(stderr, "Tuned%s: %d threads, cells %gh, renumber every %d "
+            "steps (0: by locality), %g particle-steps/s\n",
+            cached ? " (cached)" : "",
+            best.threads, best.cell, best.reorder, rate);
+
+    omp_set_num_threads(best.threads);
+    params->reorder = best.reorder;
+    if (best.cell != params->cell) {
+        params->cell = best.cell;
+        sim_state_t* s1 = clone_state(s, params);
+        build_bins(s1, params);
+        free_state(s);
+        s = s1;
+    }
+    return s;
+}
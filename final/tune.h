@@ -0,0 +1,23 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include "params.h"
+#include "state.h"
+
+/*@T
+ * \section{Auto-tuning}
+ *
+ * The [[autotune]] routine picks the OpenMP thread count, the cell
+ * width [[params->cell]] and the reorder interval [[params->reorder]]
+ * that give the most particle-steps per second for the state [[s]],
+ * by timing short runs on copies of it.  The choice is cached in the
+ * file [[params->tune]], keyed by host, available threads and particle
+ * count, so later runs of the same size skip the trials.  It sets the
+ * thread count and the parameters, and returns the state to run with:
+ * [[s]] itself, or a rebinned copy (with [[s]] freed) if the cell size
+ * changed.
+ *@c*/
+sim_state_t* autotune(sim_state_t* s, sim_param_t* params);
+
+/*@q*/
+#endif /* TUNE_H */
@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <omp.h>
+
+#include "params.h"
+#include "state.h"
+#include "interact.h"
+#include "leapfrog.h"
+#include "buckets.h"
+#include "scenario.h"
+#include "adapt.h"
+#include "taskgraph.h"
+#include "io.h"
+
+/*@T
+ * \section{Kernel validation}
+ *
+ * The [[validate.x]] driver checks optimized kernels against the
+ * all-pairs reference in [[interact_ref.c]].  Each entry in the kernel
+ * table below names a density routine and an acceleration routine with
+ * the same calling convention as [[compute_density]] and
+ * [[compute_accel]]; new kernel variants should be added here so that
+ * they are checked against the oracle before they are used.
+ *
+ * For every configuration in the configuration table and every kernel,
+ * we report the largest absolute and relative errors in [[rho]] and
+ * [[a]] after a single evaluation, and the largest difference in
+ * particle positions after running both versions for a number of
+ * steps.  Relative errors are measured against the largest reference
+ * value, since individual accelerations may cancel to near zero.  The
+ * driver exits with a nonzero status if any single-evaluation error
+ * exceeds the tolerance; trajectories of a chaotic system are expected
+ * to drift apart slowly, so the divergence is only reported.
+ *@c*/
+typedef void (*kernel_fun_t)(sim_state_t*, sim_param_t*);
+
+typedef struct kernel_t {
+    const char*  name;
+    kernel_fun_t density;
+    kernel_fun_t accel;
+} kernel_t;
+
+static const kernel_t kernels[] = {
+    {"binned", compute_density, compute_accel}
+};
+#define NKERNELS ((int) (sizeof(kernels)/sizeof(kernels[0])))
+
+/*@T
+ *
+ * The configurations cover the production lattice as well as cases
+ * that tend to break binned neighbor searches: random positions,
+ * particles sitting exactly on the walls and corners, particles exactly
+ * on cell faces, a dense clump inside a single cell, and pairs at
+ * distances just inside and just outside the interaction radius.
+ * Each filler sets positions and velocities for [[n]] particles.
+ *@c*/
+typedef void (*config_fun_t)(sim_state_t* s, sim_param_t* params);
+
+static float urand(float lo, float hi)
+{
+    return lo + (hi-lo) * (float) drand48();
+}
+
+static void random_velocities(sim_state_t* s)
+{
+    for (int i = 0; i < s->n; ++i) {
+        s->vx[i] = urand(-1, 1);
+        s->vy[i] = urand(-1, 1);
+    }
+}
+
+static void fill_random(sim_state_t* s, sim_param_t* params)
+{
+    for (int i = 0; i < s->n; ++i) {
+        s->x[i] = urand(0, 1);
+        s->y[i] = urand(0, 1);
+    }
+    random_velocities(s);
+}
+
+static void fill_walls(sim_state_t* s, sim_param_t* params)
+{
+    static const float corners[][2] = {{0,0}, {1,0}, {0,1}, {1,1}};
+    for (int i = 0; i < s->n; ++i) {
+        float t = urand(0, 1);
+        switch (i % 5) {
+        case 0: s->x[i] = 0; s->y[i] = t; break;
+        case 1: s->x[i] = 1; s->y[i] = t; break;
+        case 2: s->x[i] = t; s->y[i] = 0; break;
+        case 3: s->x[i] = t; s->y[i] = 1; break;
+        default:
+            s->x[i] = corners[i % 4][0];
+            s->y[i] = corners[i % 4][1];
+            // Keep corner particles apart so no pair has r = 0
+            s->x[i] += (s->x[i] ? -1 : 1) * 1e-3 * (i/4);
+            break;
+        }
+    }
+    random_velocities(s);
+}
+
+static void fill_faces(sim_state_t* s, sim_param_t* params)
+{
+    int MAX = s->MAX;
+    for (int i = 0; i < s->n; ++i) {
+        int k = (int) (drand48() * (MAX+1));
+        if (i % 2) {
+            s->x[i] = (float) k / MAX;
+            s->y[i] = urand(0, 1);
+        } else {
+            s->x[i] = urand(0, 1);
+            s->y[i] = (float) k / MAX;
+        }
+    }
+    random_velocities(s);
+}
+
+static void fill_clump(sim_state_t* s, sim_param_t* params)
+{
+    float h = params->h;
+    for (int i = 0; i < s->n; ++i) {
+        s->x[i] = urand(0.5, 0.5 + h);
+        s->y[i] = urand(0.5, 0.5 + h);
+    }
+    random_velocities(s);
+}
+
+static void fill_support(sim_state_t* s, sim_param_t* params)
+{
+    float h = params->h;
+    for (int i = 0; i < s->n; i += 2) {
+        float cx = urand(h, 1-h);
+        float cy = urand(h, 1-h);
+        float th = urand(0, 2*M_PI);
+        float r  = h * (1 + urand(-1e-3, 1e-3));
+        s->x[i] = cx;
+        s->y[i] = cy;
+        if (i+1 < s->n) {
+            s->x[i+1] = cx + r*cos(th);
+            s->y[i+1] = cy + r*sin(th);
+        }
+    }
+    random_velocities(s);
+}
+
+typedef struct config_t {
+    const char*  name;
+    config_fun_t fill;
+    int          settles;   /* Implicit solver can reach tolerance */
+} config_t;
+
+static const config_t configs[] = {
+    {"lattice", NULL,         1},
+    {"random",  fill_random,  1},
+    {"walls",   fill_walls,   0},
+    {"faces",   fill_faces,   1},
+    {"clump",   fill_clump,   1},
+    {"support", fill_support, 1}
+};
+#define NCONFIGS ((int) (sizeof(configs)/sizeof(configs[0])))
+
+/*@T
+ *
+ * Each kernel gets its own copy of the configuration, so the kernels
+ * under test never see state touched by the reference.  With [[-R]],
+ * every configuration goes through [[adapt_resolution]] first, so the
+ * variable resolution kernels are checked on a mix of merged and
+ * unmerged particles.
+ *@c*/
+static sim_state_t* make_config(const config_t* c, sim_param_t* params, int n)
+{
+    if (c->fill == NULL)
+        return init_particles(params);
+    sim_state_t* s = alloc_state(n, params);
+    c->fill(s, params);
+    build_bins(s, params);
+    normalize_mass(s, params);
+    if (params->adaptive)
+        adapt_resolution(s, params);
+    return s;
+}
+
+static sim_state_t* copy_state(sim_state_t* s0, sim_param_t* params)
+{
+    sim_state_t* s = clone_state(s0, params);
+    build_bins(s, params);
+    return s;
+}
+
+/* Errors in a scalar field, or in a vector field if ref1/y1 are given;
+ * position differences are taken to the nearest periodic image. */
+static void max_err(const float* ref0, const float* ref1,
+                    const float* y0, const float* y1, int m, int periodic,
+                    double* abserr, double* relerr)
+{
+    double emax = 0, rmax = 0;
+    for (int i = 0; i < m; ++i) {
+        double ex = min_image(y0[i] - ref0[i], periodic & PERIODIC_X);
+        double ey = ref1 ? min_image(y1[i] - ref1[i], periodic & PERIODIC_Y) : 0;
+        double r  = ref1 ? hypot(ref0[i], ref1[i]) : fabs(ref0[i]);
+        double e  = hypot(ex, ey);
+        if (e > emax || isnan(e)) emax = e;
+        if (r > rmax) rmax = r;
+    }
+    *abserr = emax;
+    *relerr = rmax > 0 ? emax / rmax : emax;
+}
+
+static void run_steps(sim_state_t* s, sim_param_t* params,
+                      kernel_fun_t accel, int nsteps)
+{
+    for (int i = 0; i < nsteps; ++i) {
+        accel(s, params);
+        if (i == 0)
+            leapfrog_start(s, params, params->dt);
+        else
+            leapfrog_step(s, params, params->dt);
+        update_bins(s, params);
+    }
+}
+
+/*@T
+ *
+ * With [[-T]], the task graph time step is checked as well.  It does
+ * the work of the force kernel and [[leapfrog_step]] together, so we
+ * take one step with it and one with the reference kernel followed by
+ * [[leapfrog_step]], and report the errors in [[rho]] and [[a]] as
+ * for the kernels; the last column is the difference in positions
+ * after the step, which must be within the tolerance as well.
+ *@c*/
+static int check_tiles(const config_t* c, sim_param_t* params,
+                       sim_state_t* s0, float tol)
+{
+    int m = s0->n;
+    sim_state_t* sref = copy_state(s0, params);
+    compute_accel_ref(sref, params);
+    leapfrog_step(sref, params, params->dt);
+    sim_state_t* s = copy_state(s0, params);
+    taskgraph_step(s, params, params->dt);
+
+    double rho_abs, rho_rel, a_abs, a_rel, x_abs, x_rel;
+    max_err(sref->rho, NULL, s->rho, NULL, m, 0, &rho_abs, &rho_rel);
+    max_err(sref->ax, sref->ay, s->ax, s->ay, m, 0, &a_abs, &a_rel);
+    max_err(sref->x, sref->y, s->x, s->y, m, params->periodic,
+            &x_abs, &x_rel);
+    int fail = !(rho_rel <= tol && a_rel <= tol && x_rel <= tol);
+    printf("%-8s %-8s %6d %10.3e %10.3e %10.3e %10.3e %10.3e%s\n",
+           c->name, "tiles", m, rho_abs, rho_rel, a_abs, a_rel, x_abs,
+           fail ? "  FAIL" : "");
+    free_state(s);
+    free_state(sref);
+    return fail;
+}
+
+/*@T
+ *
+ * The implicit pressure solver has no all-pairs counterpart, so with
+ * [[-i]] it is checked against its own contract instead.  From each
+ * configuration, we solve for the pressures once with a single thread
+ * and once with a team, and check that both runs stop with no particle
+ * compressed by more than [[params->implicit]] times [[rho0]] and
+ * that they agree on the pressures.  Particles that start on top of
+ * each other cannot be pushed apart in one step, so the solve is done
+ * after [[IMPLICIT_SETTLE]] explicit steps, which spread them out.
+ * The wall configuration stacks particles along the walls closely
+ * enough that no pressure removes the compression within one step, so
+ * there only the agreement is checked.  The kernel table is then
+ * checked with the explicit pressure.
+ *@c*/
+#define IMPLICIT_SETTLE 10
+
+static int solve_implicit(sim_state_t* s, sim_param_t* params, int nthreads)
+{
+    int iters = s->iters;
+#pragma omp parallel num_threads(nthreads)
+    compute_accel_implicit_ws(s, params);
+    return s->iters - iters;
+}
+
+static int check_implicit(const config_t* c, sim_param_t* params,
+                          sim_state_t* s0, float tol)
+{
+    // Make sure there is a team to compare against, even on one core
+    int nteam = omp_get_max_threads() > 1 ? omp_get_max_threads() : 4;
+    sim_param_t pk = *params;
+    pk.implicit = 0;
+    sim_state_t* s1 = copy_state(s0, params);
+    run_steps(s1, &pk, compute_accel, IMPLICIT_SETTLE);
+    sim_state_t* sn = copy_state(s1, params);
+
+    int it1 = solve_implicit(s1, params, 1);
+    int itn = solve_implicit(sn, params, nteam);
+    double p_abs, p_rel;
+    max_err(s1->p, NULL, sn->p, NULL, s1->n, 0, &p_abs, &p_rel);
+    double bound = params->implicit * params->rho0;
+    double perr = s1->perr > sn->perr ? s1->perr : sn->perr;
+
+    int fail = !((perr <= bound || !c->settles) && p_rel <= tol &&
+                 it1 == itn);
+    printf("%-8s %-8s %6d %10d %10d %10.3e %10.3e %10.3e%s\n",
+           c->name, "implicit", s1->n, it1, itn, perr / params->rho0,
+           p_abs, p_rel, fail ? "  FAIL" : "");
+    free_state(sn);
+    free_state(s1);
+    return fail;
+}
+
+/*@T
+ *
+ * With [[-O]], the driver checks the text output format instead of
+ * the kernels.  The float formatter in [[io_txt.c]] searches for the
+ * shortest decimal that reads back exactly, so we check that
+ * [[strtof]] gives back the very same bits for [[TEXT_FLOATS]] random
+ * bit patterns (skipping infinities and NaNs), for random subnormals,
+ * and for the cases where digit counts and exponents turn over:
+ * $\pm 0$, the smallest and largest floats, and every power of ten in
+ * range with its two neighbors.  Then we write the same random frame
+ * with the text and the binary writers and check that the text frame
+ * parses to the same floats and colors as the binary one.
+ *@c*/
+#define TEXT_FLOATS (1 << 21)
+
+static int text_roundtrip(float v)
+{
+    char buf[64];
+    *io_put_float(buf, v) = 0;
+    float w = strtof(buf, NULL);
+    uint32_t a, b;
+    memcpy(&a, &v, sizeof(a));
+    memcpy(&b, &w, sizeof(b));
+    if (a == b)
+        return 0;
+    static int shown = 0;
+    if (shown++ < 10)
+        printf("%.9g (0x%08x) written as %s reads back as 0x%08x\n",
+               v, a, buf, b);
+    return 1;
+}
+
+static float float_bits(uint32_t u)
+{
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+static int check_float_text(void)
+{
+    int nbad = 0, ntried = 0;
+    for (int k = 0; k < TEXT_FLOATS; ++k) {
+        uint32_t u = ((uint32_t) lrand48() << 16) ^ (uint32_t) lrand48();
+        float v = float_bits(u);
+        if (isfinite(v)) {
+            nbad += text_roundtrip(v);
+            ++ntried;
+        }
+        // Subnormal with the same mantissa and sign
+        nbad += text_roundtrip(float_bits(u & 0x807fffffu));
+        ++ntried;
+    }
+    // Smallest subnormal (FLT_TRUE_MIN is C11) and other turning points
+    const float special[] = {
+        0.0f, -0.0f, FLT_MIN, -FLT_MIN, FLT_MAX, -FLT_MAX,
+        float_bits(1), float_bits(0x80000001u), nextafterf(FLT_MIN, 0),
+        1, -1
+    };
+    for (int k = 0; k < (int) (sizeof(special)/sizeof(special[0])); ++k) {
+        nbad += text_roundtrip(special[k]);
+        ++ntried;
+    }
+    for (int e = -45; e <= 38; ++e) {
+        char dec[16];
+        sprintf(dec, "1e%d", e);
+        float v = strtof(dec, NULL);
+        nbad += text_roundtrip(v) + text_roundtrip(-v);
+        nbad += text_roundtrip(nextafterf(v, 0));
+        nbad += text_roundtrip(nextafterf(v, INFINITY));
+        ntried += 4;
+    }
+    printf("text floats: %d checked, %d do not read back exactly\n",
+           ntried, nbad);
+    return nbad;
+}
+
+static int check_frame_text(int n)
+{
+    float* x = (float*) malloc(n * sizeof(float));
+    float* y = (float*) malloc(n * sizeof(float));
+    int*   c = (int*)   malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        x[i] = urand(0, 1);
+        y[i] = urand(0, 1);
+        c[i] = (int) (lrand48() % 2001) - 1000;
+    }
+
+    FILE* ft = tmpfile();
+    FILE* fb = tmpfile();
+    io_txt.write_header(ft, n);
+    io_txt.write_frame_data(ft, n, x, y, c);
+    io_bin.write_header(fb, n);
+    io_bin.write_frame_data(fb, n, x, y, c);
+    rewind(ft);
+    rewind(fb);
+
+    int nt = -1, nb = -1, nbad = 0;
+    char tag[16];
+    uint32_t head[2];
+    if (fscanf(ft, "%15s %d %*d", tag, &nt) != 2 ||
+        strcmp(tag, "SPHView00") != 0 ||
+        fscanf(fb, "%15s", tag) != 1 || strcmp(tag, "SPHView01") != 0 ||
+        fgetc(fb) != '\n' || fread(head, sizeof(head), 1, fb) != 1)
+        nbad = n;
+    else
+        nb = (int) ntohl(head[0]);
+    for (int i = 0; i < n && nbad < n; ++i) {
+        char sx[64], sy[64];
+        int ct;
+        uint32_t rec[3];
+        if (fscanf(ft, "%63s %63s %d", sx, sy, &ct) != 3 ||
+            fread(rec, sizeof(rec), 1, fb) != 1) {
+            nbad = n;
+            break;
+        }
+        float xt = strtof(sx, NULL), yt = strtof(sy, NULL);
+        uint32_t xb = ntohl(rec[0]), yb = ntohl(rec[1]);
+        if (memcmp(&xt, &xb, 4) != 0 || memcmp(&yt, &yb, 4) != 0 ||
+            ct != (int) ntohl(rec[2]))
+            ++nbad;
+    }
+    if (nt != n || nb != n)
+        nbad = n;
+    printf("text frame: %d particles, %d differ from the binary frame\n",
+           n, nbad);
+    fclose(fb);
+    fclose(ft);
+    free(c);
+    free(y);
+    free(x);
+    return nbad;
+}
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "validate\n"
+            "\t-h: print this message\n"
+            "\t-n: particles in the generated configurations (2000)\n"
+            "\t-N: steps for the trajectory comparison (50)\n"
+            "\t-s: particle size (1e-2)\n"
+            "\t-e: relative error tolerance (1e-4)\n"
+            "\t-r: random seed (5220)\n"
+            "\t-K: check only the named kernel\n"
+            "\t-p: periodic directions: x, y or xy (none)\n"
+            "\t-R: split and merge particles before checking\n"
+            "\t-G: use the hashed sparse cell grid\n"
+            "\t-T: also check the task graph step with this tile size\n"
+            "\t-i: also check the implicit solver at this tolerance\n"
+            "\t-O: check the text output format instead of the kernels\n");
+}
+
+int main(int argc, char** argv)
+{
+    extern char* optarg;
+    int n = 2000;
+    int nsteps = 50;
+    float tol = 1e-4;
+    long seed = 5220;
+    const char* only = NULL;
+    int text = 0;
+    sim_param_t params;
+    default_params(&params);
+
+    int c;
+    while ((c = getopt(argc, argv, "hn:N:s:e:r:K:p:RGi:T:O")) != -1) {
+        switch (c) {
+        case 'n': n      = atoi(optarg); break;
+        case 'N': nsteps = atoi(optarg); break;
+        case 's': params.h = (float) atof(optarg); break;
+        case 'e': tol    = (float) atof(optarg); break;
+        case 'r': seed   = atol(optarg); break;
+        case 'K': only   = optarg; break;
+        case 'p':
+            params.periodic = (strchr(optarg, 'x') ? PERIODIC_X : 0) |
+                              (strchr(optarg, 'y') ? PERIODIC_Y : 0);
+            break;
+        case 'R': params.adaptive = 1; break;
+        case 'G': params.sparse = 1; break;
+        case 'i': params.implicit = (float) atof(optarg); break;
+        case 'T': params.tile = atoi(optarg); break;
+        case 'O': text = 1; break;
+        default:
+            print_usage();
+            exit(-1);
+        }
+    }
+
+    if (text) {
+        srand48(seed);
+        int nbad = check_float_text() + check_frame_text(n);
+        return nbad ? 1 : 0;
+    }
+    if (params.implicit > 0 && (params.adaptive || params.tile)) {
+        fprintf(stderr, "The implicit solver works without -R and -T\n");
+        exit(-1);
+    }
+    if (params.tile && params.sparse) {
+        fprintf(stderr, "The sparse grid works without -T\n");
+        exit(-1);
+    }
+    // The kernels are compared with the explicit pressure
+    sim_param_t pk = params;
+    pk.implicit = 0;
+
+    int nfail = 0;
+    printf("%-8s %-8s %6s %10s %10s %10s %10s %10s\n",
+           "config", "kernel", "n", "rho_abs", "rho_rel",
+           "a_abs", "a_rel", "traj");
+    for (int ic = 0; ic < NCONFIGS; ++ic) {
+        srand48(seed + ic);
+        sim_state_t* s0 = make_config(&configs[ic], &params, n);
+        int m = s0->n;
+
+        sim_state_t* sref = copy_state(s0, &params);
+        compute_accel_ref(sref, &pk);
+        sim_state_t* tref = copy_state(s0, &params);
+        run_steps(tref, &pk, compute_accel_ref, nsteps);
+
+        for (int ik = 0; ik < NKERNELS; ++ik) {
+            const kernel_t* k = &kernels[ik];
+            if (only && strcmp(only, k->name) != 0)
+                continue;
+
+            double rho_abs, rho_rel, a_abs, a_rel, traj, traj_rel;
+            sim_state_t* s = copy_state(s0, &params);
+            k->density(s, &pk);
+            max_err(sref->rho, NULL, s->rho, NULL, m, 0, &rho_abs, &rho_rel);
+            k->accel(s, &pk);
+            max_err(sref->ax, sref->ay, s->ax, s->ay, m, 0, &a_abs, &a_rel);
+            free_state(s);
+
+            s = copy_state(s0, &params);
+            run_steps(s, &pk, k->accel, nsteps);
+            max_err(tref->x, tref->y, s->x, s->y, m, params.periodic,
+                    &traj, &traj_rel);
+            free_state(s);
+
+            int fail = !(rho_rel <= tol && a_rel <= tol);
+            nfail += fail;
+            printf("%-8s %-8s %6d %10.3e %10.3e %10.3e %10.3e %10.3e%s\n",
+                   configs[ic].name, k->name, m, rho_abs, rho_rel,
+                   a_abs, a_rel, traj, fail ? "  FAIL" : "");
+        }
+        if (params.tile > 0 && (!only || strcmp(only, "tiles") == 0))
+            nfail += check_tiles(&configs[ic], &pk, s0, tol);
+        free_state(tref);
+        free_state(sref);
+        free_state(s0);
+    }
+
+    if (params.implicit > 0) {
+        printf("\n%-8s %-8s %6s %10s %10s %10s %10s %10s\n",
+               "config", "solver", "n", "iters_1", "iters_n", "perr_rel",
+               "p_abs", "p_rel");
+        for (int ic = 0; ic < NCONFIGS; ++ic) {
+            srand48(seed + ic);
+            sim_state_t* s0 = make_config(&configs[ic], &params, n);
+            nfail += check_implicit(&configs[ic], &params, s0, tol);
+            free_state(s0);
+        }
+    }
+
+    if (nfail)
+        printf("%d kernel/config pair(s) exceed tolerance %g\n", nfail, tol);
+    return nfail ? 1 : 0;
+}
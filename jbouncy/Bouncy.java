@@ -1,4 +1,9 @@
 import java.io.*;
+import java.net.UnixDomainSocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
+import java.nio.channels.FileChannel;
+import java.nio.channels.SocketChannel;
 import java.awt.*;
 import java.awt.event.*;
 import java.util.Observable;
@@ -6,7 +11,8 @@ import java.util.Observer;
 import java.util.Timer;
 import java.util.TimerTask;
 import java.util.Scanner;
-import java.util.Vector;
+import java.util.concurrent.ArrayBlockingQueue;
+import java.util.concurrent.TimeUnit;
 import javax.swing.*;
 import javax.swing.SwingUtilities;
 import javax.swing.filechooser.*;
@@ -30,6 +36,14 @@ public class Bouncy extends JFrame {
 
     public static void main(String[] args) {
         Bouncy c = new Bouncy();
+        if (args.length > 1 && args[0].equals("--live")) {
+            c.initLive(args[1]);
+            c.setSize(DEFAULT_SIZE, DEFAULT_SIZE);
+            c.setVisible(true);
+            c.setDefaultCloseOperation(JFrame.EXIT_ON_CLOSE);
+            c.balls.setLimits(c.view.getWidth(), c.view.getHeight());
+            return;
+        }
         if (args.length > 0)
             c.init(args[0]);
         else
@@ -56,6 +70,41 @@ public class Bouncy extends JFrame {
         balls.setLimits(view.getWidth(), view.getHeight());
     }
     
+    /*
+     * Live mode shows frames as a running simulation publishes them
+     * (sph.x -L): the source is "-" for standard input, "unix:path"
+     * for a Unix domain socket, or the path of a FIFO.  Only the newest
+     * frame is kept, so a slow display never holds up the reader.
+     */
+    public void initLive(String source) {
+        layOutComponents();
+        openButton.setEnabled(false);
+        balls.addObserver(view);
+        balls.setLimits(view.getWidth(), view.getHeight());
+        balls.addObserver(new Observer() {
+            public void update(Observable obs, Object arg) {
+                setTitle("live: " + balls.getNumFrames());
+            }
+        });
+        try {
+            balls.setLive(openLive(source));
+        } catch (IOException e) {
+            System.out.println("Could not open live source " + source +
+                               ": " + e.getMessage());
+        }
+    }
+
+    private static InputStream openLive(String source) throws IOException {
+        if (source.equals("-"))
+            return System.in;
+        if (source.startsWith("unix:")) {
+            SocketChannel ch = SocketChannel.open(
+                UnixDomainSocketAddress.of(source.substring(5)));
+            return Channels.newInputStream(ch);
+        }
+        return new FileInputStream(source);
+    }
+
     private void layOutComponents() {
         setLayout(new BorderLayout());
         this.add(BorderLayout.SOUTH, buttonPanel);
@@ -142,16 +191,24 @@ class Frame {
     private float xPositions[];
     private float yPositions[];
     private int   color[];
+    private int   index;
 
+    public int   getIndex() { return index; }
     public float getX(int i) { return xPositions[i]; }
     public float getY(int i) { return yPositions[i]; }
     public int   getColor(int i) { return color[i]; }
 
-    public Frame readTextFrame(Scanner s, int numBalls) 
-        throws IOException, java.util.InputMismatchException {
+    private void allocate(int numBalls) {
+        if (xPositions != null && xPositions.length == numBalls)
+            return;
         xPositions = new float[numBalls];
         yPositions = new float[numBalls];
         color      = new int  [numBalls];
+    }
+
+    public Frame readTextFrame(Scanner s, int numBalls) 
+        throws IOException, java.util.InputMismatchException {
+        allocate(numBalls);
         for (int i = 0; i < numBalls; ++i) {
             xPositions[i] = s.nextFloat();
             yPositions[i] = s.nextFloat();
@@ -160,11 +217,26 @@ class Frame {
         return this;
     }
 
+    public Frame readBinFrame(ByteBuffer buf, int numBalls, int index) {
+        allocate(numBalls);
+        this.index = index;
+        for (int i = 0; i < numBalls; ++i) {
+            xPositions[i] = buf.getFloat();
+            yPositions[i] = buf.getFloat();
+            color[i]      = buf.getInt();
+        }
+        return this;
+    }
+
+    public Frame readTextFrame(Scanner s, int numBalls, int index)
+        throws IOException, java.util.InputMismatchException {
+        this.index = index;
+        return readTextFrame(s, numBalls);
+    }
+
     public Frame readBinFrame(DataInputStream in, int numBalls) 
         throws IOException, EOFException {
-        xPositions = new float[numBalls];
-        yPositions = new float[numBalls];
-        color      = new int  [numBalls];
+        allocate(numBalls);
         for (int i = 0; i < numBalls; ++i) {
             xPositions[i] = in.readFloat();
             yPositions[i] = in.readFloat();
@@ -179,7 +251,6 @@ class Frame {
 class Balls extends Observable {
     public final int BALL_SIZE = 5;
 
-    private Vector frames = new Vector();
     private Frame currentFrame;
     private float scale;
     private int xLimit = Bouncy.DEFAULT_SIZE-BALL_SIZE;
@@ -188,36 +259,275 @@ class Balls extends Observable {
     private int numFrames;
     private int currentFrameIndex;
 
+    /*
+     * Frames are streamed from disk instead of being loaded up front.
+     * A reader thread fills frames taken from a small free pool and
+     * hands them to the display through a bounded queue, so at most
+     * READ_AHEAD frames are buffered however long the trajectory is,
+     * and opening a file only reads its header.  The frame shown last
+     * is held back one step before it goes back to the pool, since the
+     * event thread may still be painting it.  Playback wraps around at
+     * the end of the file.
+     */
+    private static final int READ_AHEAD = 8;
+    private ArrayBlockingQueue<Frame> ready;
+    private ArrayBlockingQueue<Frame> free;
+    private Frame previousFrame;
+    private Thread streamer;
+
     public boolean setData(File file) {
-        Scanner s = null;
+        stopStreaming();
         boolean status = false;
         try {
-            s = new Scanner(new BufferedReader(new FileReader(file)));
-            String tag = s.next();
-            if (tag.equals("SPHView00")) {
-                readTextData(s);
-                s.close();
+            DataInputStream in = new DataInputStream(
+                new BufferedInputStream(new FileInputStream(file)));
+            String tag = in.readLine();
+            in.close();
+            if (tag == null) {
+                System.out.println("Empty input file");
+            } else if (tag.startsWith("SPHView00")) {
+                startStreaming(new TextSource(file));
+                status = true;
             } else if (tag.equals("SPHView01")) {
-                s.close();
-                DataInputStream in = new DataInputStream(
-                    new BufferedInputStream(new FileInputStream(file)));
-                readBinData(in);
-                in.close();
-            }  else {
+                startStreaming(new BinSource(file, tag.length()+1));
+                status = true;
+            } else {
                 System.out.println("Unknown tag");
             }
             setChanged();
-            status = true;
         } catch(IOException e) {
             System.out.println("Failure during read");
         } catch (java.util.InputMismatchException e) {
             System.out.println("Malformed text input file");
-        } finally {
-            s.close();
+        } catch (java.util.NoSuchElementException e) {
+            System.out.println("Malformed text input file");
         }
         return status;
     }
 
+    /*
+     * A frame source fills the next frame of the trajectory, wrapping
+     * around at the end, and knows the number of frames once it has
+     * found out.  Binary frames have a fixed size, so the binary source
+     * reads them with positional reads on a file channel and knows the
+     * frame count from the file size; the text source has to read
+     * through the file once before it can say.
+     */
+    private interface FrameSource {
+        void next(Frame f) throws IOException;
+        int numFrames();
+        void close() throws IOException;
+    }
+
+    private class BinSource implements FrameSource {
+        private FileChannel ch;
+        private ByteBuffer buf;
+        private long offset;
+        private int count;
+        private int index;
+
+        BinSource(File file, int tagLength) throws IOException {
+            ch = new RandomAccessFile(file, "r").getChannel();
+            ByteBuffer head = ByteBuffer.allocate(8);
+            readFully(head, tagLength);
+            numBalls = head.getInt();
+            scale = head.getFloat();
+            offset = tagLength + 8;
+            buf = ByteBuffer.allocateDirect(12 * numBalls);
+            count = (int) ((ch.size() - offset) / Math.max(12 * numBalls, 1));
+            if (count == 0)
+                throw new EOFException();
+        }
+
+        private void readFully(ByteBuffer b, long pos) throws IOException {
+            b.clear();
+            while (b.hasRemaining()) {
+                int got = ch.read(b, pos + b.position());
+                if (got < 0)
+                    throw new EOFException();
+            }
+            b.flip();
+        }
+
+        public void next(Frame f) throws IOException {
+            readFully(buf, offset + (long) index * buf.capacity());
+            f.readBinFrame(buf, numBalls, index);
+            index = (index + 1) % count;
+        }
+
+        public int numFrames() { return count; }
+        public void close() throws IOException { ch.close(); }
+    }
+
+    private class TextSource implements FrameSource {
+        private File file;
+        private Scanner s;
+        private int count;
+        private int index;
+
+        TextSource(File file) throws IOException {
+            this.file = file;
+            rewind();
+            if (!s.hasNextFloat())
+                throw new EOFException();
+        }
+
+        private void rewind() throws IOException {
+            if (s != null)
+                s.close();
+            s = new Scanner(new BufferedReader(new FileReader(file)));
+            s.next();
+            numBalls = s.nextInt();
+            scale = s.nextFloat();
+            index = 0;
+        }
+
+        public void next(Frame f) throws IOException {
+            if (!s.hasNextFloat()) {
+                if (s.hasNext())
+                    System.out.println("Quit at: '" + s.next() + "'");
+                count = index;
+                rewind();
+            }
+            f.readTextFrame(s, numBalls, index++);
+        }
+
+        public int numFrames() { return count > 0 ? count : index; }
+        public void close() throws IOException { s.close(); }
+    }
+
+    private FrameSource source;
+
+    private void startStreaming(FrameSource src) throws IOException {
+        source = src;
+        ready = new ArrayBlockingQueue<Frame>(READ_AHEAD);
+        free  = new ArrayBlockingQueue<Frame>(READ_AHEAD + 2);
+        for (int i = 0; i < READ_AHEAD + 2; ++i)
+            free.add(new Frame());
+        currentFrame = new Frame();
+        previousFrame = null;
+        source.next(currentFrame);
+        currentFrameIndex = 0;
+
+        final FrameSource fsrc = src;
+        final ArrayBlockingQueue<Frame> fready = ready;
+        final ArrayBlockingQueue<Frame> ffree = free;
+        streamer = new Thread() {
+            public void run() {
+                try {
+                    while (true) {
+                        Frame f = ffree.take();
+                        fsrc.next(f);
+                        fready.put(f);
+                    }
+                } catch (InterruptedException e) {
+                } catch (IOException e) {
+                    System.out.println("Failure during read");
+                } catch (java.util.NoSuchElementException e) {
+                    System.out.println("Malformed text input file");
+                }
+            }
+        };
+        streamer.setDaemon(true);
+        streamer.start();
+    }
+
+    private void stopStreaming() {
+        if (streamer == null)
+            return;
+        streamer.interrupt();
+        try {
+            streamer.join();
+            source.close();
+        } catch (InterruptedException e) {
+        } catch (IOException e) {
+        }
+        streamer = null;
+        source = null;
+    }
+
+    /*
+     * In live mode a reader thread fills a spare frame and swaps it
+     * with the latest one; the event thread swaps the latest frame in
+     * for display just before repainting.  Three frames are reused for
+     * the whole session.
+     */
+    private Frame latestFrame;
+    private Frame spareFrame;
+    private boolean fresh;
+    private int liveFrames;
+
+    public void setLive(InputStream raw) throws IOException {
+        stopStreaming();
+        final DataInputStream in =
+            new DataInputStream(new BufferedInputStream(raw));
+        String header = in.readLine();
+        if (header == null)
+            throw new EOFException();
+        final Scanner s;
+        if (header.startsWith("SPHView00")) {
+            Scanner h = new Scanner(header.substring(9));
+            numBalls = h.nextInt();
+            scale = h.nextFloat();
+            s = new Scanner(in);
+        } else if (header.equals("SPHView01")) {
+            numBalls = in.readInt();
+            scale = in.readFloat();
+            s = null;
+        } else {
+            throw new IOException("Unknown tag");
+        }
+        final int n = numBalls;
+        numBalls = 0;  // Nothing to draw until the first frame arrives
+        currentFrame = new Frame();
+        latestFrame  = new Frame();
+        spareFrame   = new Frame();
+
+        Thread reader = new Thread() {
+            public void run() {
+                try {
+                    while (true) {
+                        if (s != null)
+                            spareFrame.readTextFrame(s, n);
+                        else
+                            spareFrame.readBinFrame(in, n);
+                        synchronized (Balls.this) {
+                            Frame t = latestFrame;
+                            latestFrame = spareFrame;
+                            spareFrame = t;
+                            fresh = true;
+                        }
+                        SwingUtilities.invokeLater(new Runnable() {
+                            public void run() { showLatest(n); }
+                        });
+                    }
+                } catch (EOFException e) {
+                } catch (java.util.NoSuchElementException e) {
+                } catch (IOException e) {
+                    System.out.println("Live source failed: " +
+                                       e.getMessage());
+                }
+            }
+        };
+        reader.setDaemon(true);
+        reader.start();
+    }
+
+    private void showLatest(int n) {
+        synchronized (this) {
+            if (!fresh)
+                return;
+            Frame t = currentFrame;
+            currentFrame = latestFrame;
+            latestFrame = t;
+            fresh = false;
+            ++liveFrames;
+        }
+        numBalls = n;
+        setChanged();
+        notifyObservers();
+    }
+
     public void setLimits(int xLimit, int yLimit) {
         this.xLimit = xLimit - BALL_SIZE;
         this.yLimit = yLimit - BALL_SIZE;
@@ -228,7 +538,9 @@ class Balls extends Observable {
     }
 
     public int getNumFrames() {
-        return frames.size();
+        if (latestFrame != null)
+            return liveFrames;
+        return source != null ? source.numFrames() : 0;
     }
 
     public int getX(int i) {
@@ -239,8 +551,20 @@ class Balls extends Observable {
         return (int) ((1-currentFrame.getY(i)/scale) * yLimit);
     }
 
+    // Colors from 256 up are quantized output channels (see channel.h),
+    // drawn on a ramp from blue (low) to red (high)
+    private static final int CHANNEL_BASE = 256;
+    private static final Color ramp[] = new Color[256];
+    static {
+        for (int q = 0; q < 256; ++q)
+            ramp[q] = Color.getHSBColor(0.66f * (255-q) / 255, 1, 1);
+    }
+
     public Color getColor(int i) {
-        if (currentFrame.getColor(i) == 0) {
+        int c = currentFrame.getColor(i);
+        if (c >= CHANNEL_BASE && c < CHANNEL_BASE + 256) {
+            return ramp[c - CHANNEL_BASE];
+        } else if (c == 0) {
             return Color.red;
         } else {
             return Color.blue;
@@ -248,46 +572,26 @@ class Balls extends Observable {
     }
 
     public int makeOneStep() {
-        // Do the work
-        ++currentFrameIndex;
-        if (currentFrameIndex >= getNumFrames())
-            currentFrameIndex = 0;
-        currentFrame = (Frame) frames.get(currentFrameIndex);
+        // Do the work; if the reader has fallen behind, show the
+        // current frame again rather than stall the caller
+        Frame next = null;
+        try {
+            next = ready.poll(40, TimeUnit.MILLISECONDS);
+        } catch (InterruptedException e) {
+        }
+        if (next != null) {
+            if (previousFrame != null)
+                free.add(previousFrame);
+            previousFrame = currentFrame;
+            currentFrame = next;
+            currentFrameIndex = next.getIndex();
+        }
 
         // Notify observers
         setChanged();
         notifyObservers();
         return currentFrameIndex;
     }
-
-    private void readTextData(Scanner s) 
-        throws IOException, java.util.InputMismatchException {
-        frames.clear();
-        currentFrameIndex = 0;
-        numBalls = s.nextInt();
-        scale = s.nextFloat();
-        while (s.hasNextFloat()) {
-            frames.add(new Frame().readTextFrame(s, numBalls));
-        }
-        if (s.hasNext())
-            System.out.println("Quit at: '" + s.next() + "'");
-        currentFrame = (Frame) frames.get(currentFrameIndex);
-    }
-
-    private void readBinData(DataInputStream in) 
-        throws IOException {
-        frames.clear();
-        currentFrameIndex = 0;
-        in.readLine();
-        numBalls = in.readInt();
-        scale = in.readFloat();
-        try {
-            while (true) 
-                frames.add(new Frame().readBinFrame(in, numBalls));
-        } catch (EOFException e) {
-        }
-        currentFrame = (Frame) frames.get(currentFrameIndex);
-    }
 }
 
 //---------------------------------------------------------------------